@@ -1,26 +1,29 @@
 #include <stddef.h>
 #include <stdio.h>
-#include <pthread.h>
+#include "threadpool.h"
 
-void *run(void *arg)
+void run(void *arg)
 {
 	char *string_to_print = arg;
 	int i;
 	for (i=0; i<5; i++){
 		printf("%s: %d\n", string_to_print, i);
 	}
-	return NULL;
 }
 
 int main(void)
 {
-	pthread_t t1, t2;
+	struct threadpool *pool = threadpool_create(2, 0);
+	if (pool == NULL) {
+		fprintf(stderr, "hellothread: can't start threads\n");
+		return 1;
+	}
 	// int x = 12;
 	printf("%s\n", "Launching threads");
-	pthread_create(&t1, NULL, run, "thread 1");
-	pthread_create(&t2, NULL, run, "thread 2");
-	pthread_join(t1, NULL);
-  pthread_join(t2, NULL);
+	threadpool_submit(pool, run, "thread 1");
+	threadpool_submit(pool, run, "thread 2");
+	threadpool_wait(pool);
 	printf("%s\n", "Threads complete!");
+	threadpool_free(pool);
 
 }
@@ -1,74 +1,621 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sched.h>
 #include <pthread.h>
+#include "threadpool.h"
+
+#define SEATS_PER_WORD 64
+#define STRIPE_WORDS 64                               // Bitmap words per stripe
+#define STRIPE_SEATS (STRIPE_WORDS * SEATS_PER_WORD)  // 4096 seats share a lock and a count
+#define CACHE_LINE 64
+#define AUDIT_INTERVAL_MS 100                         // How often the auditor checks every stripe
+#define TOUCHED_MAX 8                                 // Stripes VERIFY_LOCAL will check after one transaction
+#define BATCH_STACK 64                                // Seats a batch can sort without malloc()
+
+// How reserve_seat() and free_seat() keep brokers from stepping on each
+// other. ENGINE_MUTEX is the original: one lock around everything.
+// ENGINE_STRIPED gives every STRIPE_SEATS seats their own lock and count,
+// so brokers only wait for each other when they hit the same stripe.
+// ENGINE_LOCKFREE takes no locks at all; a seat is claimed with one atomic
+// operation on the word that holds its bit.
+enum engine { ENGINE_MUTEX, ENGINE_STRIPED, ENGINE_LOCKFREE };
+
+// How much verify_seat_count() looks at. VERIFY_FULL checks every seat.
+// VERIFY_LOCAL checks only the stripe the caller's last change was in, and
+// leaves the rest to an auditor thread that goes over all of them every
+// AUDIT_INTERVAL_MS.
+enum verify { VERIFY_FULL, VERIFY_LOCAL };
 
 // These will be initialized in main() from the command line.
 int seat_count;
 int broker_count;
-int *seat_taken;  // Array of seats
+unsigned long long *seat_taken;  // Bitmap of seats: seat n is bit n % 64 of word n / 64
 int transaction_count;
+enum engine engine = ENGINE_LOCKFREE;
+enum verify verify = VERIFY_LOCAL;
 
-int seat_taken_count = 0;
+int seat_taken_count = 0;  // ENGINE_MUTEX only; the others only count per stripe
 
 pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Each stripe's count goes up and down with its seats, so nothing is shared
+// between brokers working in different stripes, and the total is only
+// added up when somebody asks for it. A stripe gets a cache line to itself.
+//
+// ENGINE_LOCKFREE has no lock to hold while it checks a stripe, so every
+// change to a stripe bumps begun before it touches the bitmap and finished
+// once the count is right again. When the two match, nobody is in the
+// middle of a change.
+struct stripe {
+    pthread_mutex_t lock;    // ENGINE_STRIPED
+    long count;              // Taken seats in this stripe (ENGINE_MUTEX keeps it too, under lock_mutex)
+    unsigned long begun;     // ENGINE_LOCKFREE
+    unsigned long finished;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct stripe *stripes;
+int stripe_count;
+
+static __thread int touched[TOUCHED_MAX];  // The stripes this thread's last transaction changed, for VERIFY_LOCAL
+static __thread int touched_count;         // More than TOUCHED_MAX means check them all
+static __thread unsigned long long lock_wait_ns;  // Time this thread spent waiting for engine locks
+static int audit_failed;  // Set by the auditor when it finds a stripe that doesn't add up
+static int audit_stop;
+static pthread_mutex_t audit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t audit_wake = PTHREAD_COND_INITIALIZER;  // So the auditor stops right away, not at its next check
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void engine_lock(pthread_mutex_t *lock) {  // pthread_mutex_lock(), keeping track of how long we waited
+    if (pthread_mutex_trylock(lock) == 0)
+        return;
+    unsigned long long start = now_ns();
+    pthread_mutex_lock(lock);
+    lock_wait_ns += now_ns() - start;
+}
+
+static unsigned long long *seat_word(int n) {
+    return &seat_taken[n / SEATS_PER_WORD];
+}
+
+static unsigned long long seat_bit(int n) {
+    return 1ULL << (n % SEATS_PER_WORD);
+}
+
+static struct stripe *seat_stripe(int n) {
+    return &stripes[n / STRIPE_SEATS];
+}
+
 int is_free(int n) {
     // Returns true if the given seat is available.
-    return seat_taken[n] == 0;
+    return (__atomic_load_n(seat_word(n), __ATOMIC_RELAXED) & seat_bit(n)) == 0;
+}
+
+static void stripe_begin(struct stripe *s) {  // ENGINE_LOCKFREE: about to change s
+    __atomic_fetch_add(&s->begun, 1, __ATOMIC_SEQ_CST);
+}
+
+static void stripe_end(struct stripe *s) {
+    __atomic_fetch_add(&s->finished, 1, __ATOMIC_SEQ_CST);
+}
+
+// Set (taken) or clear (!taken) seat n's bit if it isn't already, and keep
+// the count in step. Returns 0 if it changed, -1 if the seat was already
+// that way. The caller holds whatever lock the engine needs.
+static int set_seat(int n, int taken, int *count) {
+    unsigned long long *word = seat_word(n), bit = seat_bit(n);
+    unsigned long long old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    if (((old & bit) != 0) == taken) {
+        return -1;
+    }
+    __atomic_store_n(word, old ^ bit, __ATOMIC_RELAXED);  // Atomic only so is_free() can peek without the lock
+    *count += taken? 1: -1;
+    return 0;
+}
+
+static int change_seat(int n, int taken) {
+    int result, delta = 0;
+    struct stripe *s;
+
+    if (n < 0 || n >= seat_count) {
+        return -1;
+    }
+    touched[0] = n / STRIPE_SEATS;
+    touched_count = 1;
+    switch (engine) {
+    case ENGINE_MUTEX:
+        s = seat_stripe(n);
+        engine_lock(&lock_mutex);
+        result = set_seat(n, taken, &delta);
+        seat_taken_count += delta;
+        s->count += delta;
+        pthread_mutex_unlock(&lock_mutex);
+        return result;
+
+    case ENGINE_STRIPED:
+        s = seat_stripe(n);
+        engine_lock(&s->lock);
+        result = set_seat(n, taken, &delta);
+        s->count += delta;
+        pthread_mutex_unlock(&s->lock);
+        return result;
+
+    case ENGINE_LOCKFREE:
+    default:
+        s = seat_stripe(n);
+        stripe_begin(s);
+        unsigned long long bit = seat_bit(n), old;
+        if (taken) {
+            old = __atomic_fetch_or(seat_word(n), bit, __ATOMIC_SEQ_CST);
+        } else {
+            old = __atomic_fetch_and(seat_word(n), ~bit, __ATOMIC_SEQ_CST);
+        }
+        result = ((old & bit) != 0) == taken? -1: 0;  // Somebody beat us to it
+        if (result == 0) {
+            __atomic_fetch_add(&s->count, taken? 1: -1, __ATOMIC_SEQ_CST);
+        }
+        stripe_end(s);
+        return result;
+    }
 }
 
 int reserve_seat(int n)
 {
-    int is_taken = -1;     // If the seat is already taken, return -1
- 
-    pthread_mutex_lock(&lock_mutex);
-    if (is_free(n)) {     // Attempt to reserve seat number n
-        seat_taken[n] = 1;
-        seat_taken_count++;     // This function should also increment seat_taken_count if the seat wasn't already taken.
-        is_taken = 0;     // Otherwise mark the seat as taken and return 0
-    }
-    pthread_mutex_unlock(&lock_mutex);
-    return is_taken;  // Change as necessary--included so it will build
+    return change_seat(n, 1);  // If the seat is already taken, return -1
 }
 
 int free_seat(int n)
 {
-    int is_seat_free = -1;     // If the seat is already free, return -1
+    return change_seat(n, 0);  // If the seat is already free, return -1
+}
+
+// ------------------- Batches -------------------
+
+// A batch is a list of bitmap words, in increasing order, and the bits to
+// claim in each. claim_words() takes all of them or none: the mutex engine
+// checks and sets them under lock_mutex, the striped engine locks every
+// stripe involved in increasing order (so two batches can't deadlock), and
+// the lock-free engine sets one word at a time with compare-and-swap and
+// clears the ones it already set if a later word has a conflict.
+struct claim {
+    int word;
+    unsigned long long bits;
+};
+
+static void touch_stripes(const struct claim *claims, int n) {  // Note them down for VERIFY_LOCAL
+    touched_count = 0;
+    for (int i = 0; i < n; i++) {
+        int stripe = claims[i].word / STRIPE_WORDS;
+        if (touched_count > 0 && touched_count <= TOUCHED_MAX && touched[touched_count - 1] == stripe)
+            continue;
+        if (touched_count < TOUCHED_MAX)
+            touched[touched_count] = stripe;
+        touched_count++;
+    }
+}
+
+static void count_claims(const struct claim *claims, int n) {  // Add the claimed bits to their stripes' counts
+    for (int i = 0; i < n; i++) {
+        long bits = __builtin_popcountll(claims[i].bits);
+        if (engine == ENGINE_LOCKFREE)
+            __atomic_fetch_add(&stripes[claims[i].word / STRIPE_WORDS].count, bits, __ATOMIC_SEQ_CST);
+        else
+            stripes[claims[i].word / STRIPE_WORDS].count += bits;
+    }
+}
+
+static void lock_claims(const struct claim *claims, int n, int lock) {  // Each stripe involved once, in order
+    int last = -1;
+    for (int i = 0; i < n; i++) {
+        int stripe = claims[i].word / STRIPE_WORDS;
+        if (stripe == last)
+            continue;
+        last = stripe;
+        if (engine == ENGINE_STRIPED && lock)
+            engine_lock(&stripes[stripe].lock);
+        else if (engine == ENGINE_STRIPED)
+            pthread_mutex_unlock(&stripes[stripe].lock);
+        else if (lock)
+            stripe_begin(&stripes[stripe]);
+        else
+            stripe_end(&stripes[stripe]);
+    }
+}
+
+static int claim_words(const struct claim *claims, int n) {
+    int result = 0;
+    touch_stripes(claims, n);
+    if (engine == ENGINE_MUTEX)
+        engine_lock(&lock_mutex);
+    else
+        lock_claims(claims, n, 1);
+
+    if (engine != ENGINE_LOCKFREE) {
+        for (int i = 0; i < n && result == 0; i++)
+            if (__atomic_load_n(&seat_taken[claims[i].word], __ATOMIC_RELAXED) & claims[i].bits)
+                result = -1;
+        for (int i = 0; i < n && result == 0; i++)
+            __atomic_fetch_or(&seat_taken[claims[i].word], claims[i].bits, __ATOMIC_RELAXED);
+    } else {
+        // Each word is counted as soon as its bits are set: from then on a
+        // free_seat() may clear one of them and uncount it, so giving the
+        // word back only uncounts the bits that were still ours.
+        int done = 0;
+        for (; done < n; done++) {
+            unsigned long long *word = &seat_taken[claims[done].word];
+            unsigned long long old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            do {
+                if (old & claims[done].bits)
+                    break;
+            } while (!__atomic_compare_exchange_n(word, &old, old | claims[done].bits, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+            if (old & claims[done].bits) {
+                result = -1;
+                break;
+            }
+            count_claims(&claims[done], 1);
+        }
+        while (result == -1 && done-- > 0) {  // Give back what we got before the conflict
+            unsigned long long old = __atomic_fetch_and(&seat_taken[claims[done].word], ~claims[done].bits, __ATOMIC_SEQ_CST);
+            long bits = __builtin_popcountll(old & claims[done].bits);
+            __atomic_fetch_sub(&stripes[claims[done].word / STRIPE_WORDS].count, bits, __ATOMIC_SEQ_CST);
+        }
+    }
+    if (result == 0 && engine != ENGINE_LOCKFREE) {
+        count_claims(claims, n);
+        if (engine == ENGINE_MUTEX)
+            for (int i = 0; i < n; i++)
+                seat_taken_count += __builtin_popcountll(claims[i].bits);
+    }
+
+    if (engine == ENGINE_MUTEX)
+        pthread_mutex_unlock(&lock_mutex);
+    else
+        lock_claims(claims, n, 0);
+    return result;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Reserve all n seats or none of them. Returns -1, reserving nothing, if
+// any of them is taken, out of range, or listed twice.
+int reserve_seats(const int *seats, int n)
+{
+    int sorted_stack[BATCH_STACK];
+    struct claim claims_stack[BATCH_STACK];
+    int *sorted = n <= BATCH_STACK? sorted_stack: malloc(n * sizeof *sorted);
+    struct claim *claims = n <= BATCH_STACK? claims_stack: malloc(n * sizeof *claims);
+    int result = -1, count = 0;
 
-    pthread_mutex_lock(&lock_mutex);
-    if (!is_free(n)) {    // Attempt to free (unreserve) seat number n
-        seat_taken[n] = 0;
-        seat_taken_count--;    // This function should also decrement seat_taken_count if the seat wasn't already free.
-        is_seat_free = 0;    // Otherwise mark the seat as free and return 0
+    if (n <= 0 || sorted == NULL || claims == NULL)
+        goto done;
+    memcpy(sorted, seats, n * sizeof *sorted);
+    qsort(sorted, n, sizeof *sorted, compare_ints);
+    if (sorted[0] < 0 || sorted[n - 1] >= seat_count)
+        goto done;
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && sorted[i] == sorted[i - 1])
+            goto done;
+        int word = sorted[i] / SEATS_PER_WORD;
+        if (count == 0 || claims[count - 1].word != word)
+            claims[count++] = (struct claim){ word, 0 };
+        claims[count - 1].bits |= seat_bit(sorted[i]);
     }
-    pthread_mutex_unlock(&lock_mutex);
+    result = claim_words(claims, count);
+
+done:
+    if (sorted != sorted_stack)
+        free(sorted);
+    if (claims != claims_stack)
+        free(claims);
+    return result;
+}
 
-    return is_seat_free;  // Change as necessary--included so it will build
+static unsigned long long taken_word(int w) {
+    return __atomic_load_n(&seat_taken[w], __ATOMIC_RELAXED);
 }
 
+// The first seat of the first run of count free seats at or after from, or
+// -1 if there isn't one. It looks at a word at a time: a run can carry on
+// from the top of one word into the bottom of the next, and a run inside
+// one word shows up as a set bit after ANDing the free bits with
+// themselves shifted down count - 1 times (in doubling steps). Nothing is
+// locked, so by the time it returns the run may be gone.
+static int find_run(int count, int from) {
+    int words = (seat_count + SEATS_PER_WORD - 1) / SEATS_PER_WORD;
+    long run = 0;  // Free seats running up to the end of the last word
+    int run_start = from;
+    for (int w = from / SEATS_PER_WORD; w < words; w++) {
+        unsigned long long taken = taken_word(w);
+        if (w == from / SEATS_PER_WORD)
+            taken |= seat_bit(from) - 1;  // Seats before from don't count
+        if (run == 0)
+            run_start = w * SEATS_PER_WORD;
+        if (taken == 0) {
+            run += SEATS_PER_WORD;
+            if (run >= count)
+                break;
+            continue;
+        }
+        if (run + __builtin_ctzll(taken) >= count) {  // The run from before ends in the bottom of this word
+            run = count;
+            break;
+        }
+        if (count <= SEATS_PER_WORD) {
+            unsigned long long starts = ~taken;
+            for (int len = 1; len < count; ) {
+                int shift = len < count - len? len: count - len;
+                starts &= starts >> shift;
+                len += shift;
+            }
+            if (starts != 0) {
+                run_start = w * SEATS_PER_WORD + __builtin_ctzll(starts);
+                run = count;
+                break;
+            }
+        }
+        run = __builtin_clzll(taken);
+        run_start = (w + 1) * SEATS_PER_WORD - run;
+    }
+    return run >= count && run_start + count <= seat_count? run_start: -1;
+}
+
+// Reserve count adjacent seats, the first free run there is, all at once.
+// Sets *start_out to the first of them and returns 0, or returns -1 if
+// there's no run that long free.
+int reserve_contiguous(int count, int *start_out)
+{
+    if (count <= 0 || count > seat_count)
+        return -1;
+    int words = (count + 2 * SEATS_PER_WORD - 2) / SEATS_PER_WORD;  // Most words a run can cover
+    struct claim claims_stack[BATCH_STACK];
+    struct claim *claims = words <= BATCH_STACK? claims_stack: malloc(words * sizeof *claims);
+    if (claims == NULL)
+        return -1;
+
+    int start, from = 0, result = -1;
+    while ((start = find_run(count, from)) != -1) {
+        int n = 0;
+        for (int seat = start; seat < start + count; ) {  // The run as a batch, a word at a time
+            int in_word = SEATS_PER_WORD - seat % SEATS_PER_WORD;
+            int take = in_word < start + count - seat? in_word: start + count - seat;
+            unsigned long long bits = take == SEATS_PER_WORD? ~0ULL: ((1ULL << take) - 1) << (seat % SEATS_PER_WORD);
+            claims[n++] = (struct claim){ seat / SEATS_PER_WORD, bits };
+            seat += take;
+        }
+        if (claim_words(claims, n) == 0) {
+            *start_out = start;
+            result = 0;
+            break;
+        }
+        from = start + 1;  // Somebody took part of it first; look further on
+    }
+    if (claims != claims_stack)
+        free(claims);
+    return result;
+}
+
+static long count_bits(const unsigned long long *words, int n) {
+    long count = 0;
+    for (int i = 0; i < n; i++)
+        count += __builtin_popcountll(__atomic_load_n(&words[i], __ATOMIC_SEQ_CST));
+    return count;
+}
+
+// True if stripe i's count matches its bits. Under ENGINE_LOCKFREE it
+// waits for a moment when nobody is changing the stripe, looks, and tries
+// again if somebody started while it was looking.
+static int stripe_consistent(int i) {
+    struct stripe *s = &stripes[i];
+    const unsigned long long *words = seat_taken + (long)i * STRIPE_WORDS;
+
+    if (engine != ENGINE_LOCKFREE) {
+        pthread_mutex_t *lock = engine == ENGINE_MUTEX? &lock_mutex: &s->lock;
+        engine_lock(lock);
+        int ok = count_bits(words, STRIPE_WORDS) == s->count;
+        pthread_mutex_unlock(lock);
+        return ok;
+    }
+    for (;;) {
+        unsigned long finished = __atomic_load_n(&s->finished, __ATOMIC_SEQ_CST);
+        unsigned long begun = __atomic_load_n(&s->begun, __ATOMIC_SEQ_CST);
+        if (begun != finished) {  // Counts as waiting for a lock, as far as the benchmark goes
+            unsigned long long start = now_ns();
+            sched_yield();
+            lock_wait_ns += now_ns() - start;
+            continue;
+        }
+        long count = __atomic_load_n(&s->count, __ATOMIC_SEQ_CST);
+        long bits = count_bits(words, STRIPE_WORDS);
+        if (__atomic_load_n(&s->begun, __ATOMIC_SEQ_CST) == begun)
+            return bits == count;
+    }
+}
+
+int seat_taken_total(void) {  // How many seats are taken, added up from the stripes if need be
+    if (engine == ENGINE_MUTEX)
+        return __atomic_load_n(&seat_taken_count, __ATOMIC_RELAXED);
+    long total = 0;
+    for (int i = 0; i < stripe_count; i++)
+        total += __atomic_load_n(&stripes[i].count, __ATOMIC_RELAXED);
+    return total;
+}
+
+static int verify_all(void) {
+    // Counts all the taken seats and compares that with the count we kept.
+    // Every change keeps a stripe's count in step with its own bits, so the
+    // striped engines can check one stripe at a time without stopping the
+    // others, and the whole thing is right if every stripe is.
+    if (engine == ENGINE_MUTEX) {
+        engine_lock(&lock_mutex);
+        int is_verified = count_bits(seat_taken, stripe_count * STRIPE_WORDS) == seat_taken_count;
+        pthread_mutex_unlock(&lock_mutex);
+        return is_verified;  // It returns true if they are the same, false otherwise
+    }
+    for (int i = 0; i < stripe_count; i++)
+        if (!stripe_consistent(i))
+            return 0;
+    return 1;
+}
+
+// With VERIFY_LOCAL this is O(1) in the size of the venue: one transaction
+// only changes one stripe, so if it broke anything, it broke that stripe,
+// and that's the one we check. The auditor covers whatever else could go
+// wrong, and once it has found a problem every broker hears about it.
 int verify_seat_count(void) {
-    int count = 0;
+    if (verify == VERIFY_FULL)
+        return verify_all();
+    if (__atomic_load_n(&audit_failed, __ATOMIC_RELAXED))
+        return 0;
+    if (touched_count > TOUCHED_MAX)
+        return verify_all();
+    for (int i = 0; i < touched_count; i++)
+        if (!stripe_consistent(touched[i]))
+            return 0;
+    return 1;
+}
+
+static void *seat_auditor(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&audit_lock);
+    while (!audit_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += AUDIT_INTERVAL_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&audit_wake, &audit_lock, &until) == 0 || audit_stop)
+            continue;
+        pthread_mutex_unlock(&audit_lock);
+        if (!verify_all())
+            __atomic_store_n(&audit_failed, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&audit_lock);
+    }
+    pthread_mutex_unlock(&audit_lock);
+    return NULL;
+}
+
+// ------------------- Brokers -------------------
+
+// Each broker has its own xorshift64* generator. rand() takes a lock inside
+// glibc, so with it every broker would be waiting on the others before it
+// ever got to the seats.
+//
+// Seats are picked uniformly, or with -z s from a Zipf distribution of
+// exponent s: seat k (counting from 0) gets picked in proportion to
+// 1/(k+1)^s, so the front rows are where the fights are. Picks use the
+// inverse of the continuous approximation to the Zipf CDF, which is one
+// pow() instead of a table the size of the venue.
+
+#define LATENCY_SUB_BITS 4                          // Histogram accuracy: 1/16th of a power of two
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+struct broker {
+    int id;
+    unsigned long long rng;
+    long transactions;
+    long seen_free;                 // What the reads found, so they aren't optimized away
+    unsigned long long elapsed_ns;  // From the broker's first transaction to its last
+    unsigned long long wait_ns;     // Waiting for engine locks
+    unsigned long long latency[LATENCY_BUCKETS];
+};
+
+int benchmark;        // -b: time everything and print a report instead of the usual messages
+int read_percent;     // -r: share of transactions that only look at a seat
+double zipf_skew;     // -z: 0 for uniform
+int pin_brokers;      // -p: worker i runs on CPU i % CPUs
+int worker_count;     // -w: threads the brokers share; one each if 0
+int group_size = 1;   // -g: buys are groups of this many seats, by turns scattered and side by side
+static double zipf_span;  // (seat_count + 1)^(1 - s) - 1, worked out once
+
+static unsigned long long next_random(struct broker *b) {
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return b->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static int pick_seat(struct broker *b) {
+    unsigned long long r = next_random(b);
+    if (zipf_skew == 0)
+        return (int)(((r >> 32) * (unsigned long long)seat_count) >> 32);
+    double u = (r >> 11) * (1.0 / 9007199254740992.0);  // [0, 1)
+    double x;
+    if (fabs(zipf_skew - 1) < 1e-9)
+        x = pow(seat_count + 1.0, u);
+    else
+        x = pow(1 + u * zipf_span, 1 / (1 - zipf_skew));
+    int seat = (int)x - 1;
+    return seat < 0? 0: seat >= seat_count? seat_count - 1: seat;
+}
+
+static int latency_bucket(unsigned long long ns) {  // Log-linear: exact below 16, then 16 steps per power of two
+    if (ns < (1 << LATENCY_SUB_BITS))
+        return ns;
+    int top = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (top - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+    return ((top - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
 
-    pthread_mutex_lock(&lock_mutex);
-    for (int i = 0; i < seat_count; i++)
-        if (seat_taken[i])
-            count++;     // This function counts all the taken seats in the seat_taken[] array.
-    int is_verified = (count == seat_taken_count);     // It then compares the count with the seat_count global variable.
-    // Return true if it's the same as seat_taken_count
-    pthread_mutex_unlock(&lock_mutex);
-    return is_verified;     // It returns true if they are the same, false otherwise
+static unsigned long long bucket_top(int bucket) {  // The largest latency that lands in bucket
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return bucket;
+    int top = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    unsigned long long sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+    unsigned long long low = (1ULL << top) + (sub << (top - LATENCY_SUB_BITS));
+    return low + (1ULL << (top - LATENCY_SUB_BITS)) - 1;
 }
 
-// ------------------- DO NOT MODIFY PAST THIS LINE -------------------
+static unsigned long long percentile(const unsigned long long *latency, double pct) {
+    unsigned long long total = 0, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        total += latency[i];
+    unsigned long long want = (unsigned long long)ceil(total * pct / 100);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen >= want && seen > 0)
+            return bucket_top(i);
+    }
+    return 0;
+}
 
-void *seat_broker(void *arg)
+void seat_broker(void *arg)
 {
-    int *id = arg;
+    struct broker *b = arg;
+    int *id = &b->id;
 
+    unsigned long long waited = lock_wait_ns;  // Brokers that share a worker share its count
+    unsigned long long started = benchmark? now_ns(): 0;
     for (int i = 0; i < transaction_count; i++) {
-        int seat = rand() % seat_count;
-        if (rand() & 1) {
+        unsigned long long start = benchmark? now_ns(): 0;
+        int seat = pick_seat(b);
+        unsigned long long r = next_random(b);
+        if ((int)(r % 100) < read_percent) {
+            // look at a random seat
+            b->seen_free += is_free(seat);
+        } else if (((r >> 32) & 1) && group_size > 1) {
+            // buy a group of seats: random ones, or the first run of them together
+            if ((r >> 33) & 1) {
+                int group[BATCH_STACK];
+                group[0] = seat;
+                for (int k = 1; k < group_size; k++)
+                    group[k] = pick_seat(b);
+                reserve_seats(group, group_size);
+            } else {
+                int start;
+                reserve_contiguous(group_size, &start);
+            }
+        } else if ((r >> 32) & 1) {
             // buy a random seat
             reserve_seat(seat);
 
@@ -80,46 +627,161 @@ void *seat_broker(void *arg)
         if (!verify_seat_count()) {
             printf("Broker %d: the seat count seems to be off! " \
                    "I quit!\n", *id);
-            return NULL;
+            return;
         }
+        b->transactions++;
+        if (benchmark)
+            b->latency[latency_bucket(now_ns() - start)]++;
+    }
+    if (benchmark) {
+        b->elapsed_ns = now_ns() - started;
+        b->wait_ns = lock_wait_ns - waited;
+        return;
     }
 
     printf("Broker %d: That all seemed to work very well.\n", *id);
+}
 
-    return NULL;
+static void report(struct broker *brokers, unsigned long long wall_ns) {
+    static const char *engine_names[] = { "mutex", "striped", "lockfree" };
+    static unsigned long long all[LATENCY_BUCKETS];
+    long transactions = 0;
+    unsigned long long wait_ns = 0;
+
+    printf("engine %s, verify %s, %d seats, %d brokers on %d threads, %d%% reads, skew %g, groups of %d%s\n",
+           engine_names[engine], verify == VERIFY_FULL? "full": "local", seat_count, broker_count,
+           worker_count, read_percent, zipf_skew, group_size, pin_brokers? ", pinned": "");
+    printf("%6s %12s %14s %12s %10s %10s\n", "broker", "transactions", "tx/sec", "lock_wait_ms", "p50_ns", "p99_ns");
+    for (int i = 0; i < broker_count; i++) {
+        struct broker *b = &brokers[i];
+        double seconds = b->elapsed_ns / 1e9;
+        printf("%6d %12ld %14.0f %12.3f %10llu %10llu\n", b->id, b->transactions,
+               seconds > 0? b->transactions / seconds: 0, b->wait_ns / 1e6,
+               percentile(b->latency, 50), percentile(b->latency, 99));
+        transactions += b->transactions;
+        wait_ns += b->wait_ns;
+        for (int k = 0; k < LATENCY_BUCKETS; k++)
+            all[k] += b->latency[k];
+    }
+    printf("%6s %12ld %14.0f %12.3f %10llu %10llu\n", "all", transactions,
+           wall_ns > 0? transactions / (wall_ns / 1e9): 0, wait_ns / 1e6,
+           percentile(all, 50), percentile(all, 99));
+    printf("seats taken at the end: %d\n", seat_taken_total());
+}
+
+static int parse_engine(const char *name) {
+    static const char *names[] = { "mutex", "striped", "lockfree" };
+    for (int i = 0; i < (int)(sizeof names / sizeof names[0]); i++)
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    return -1;
 }
 
 int main(int argc, char *argv[])
 {
     // Parse command line
-    if (argc != 4) {
-        fprintf(stderr, "usage: reservations seat_count broker_count xaction_count\n");
+    int opt, bad = 0;
+    while ((opt = getopt(argc, argv, "e:v:br:z:pw:g:")) != -1) {
+        if (opt == 'e' && parse_engine(optarg) != -1)
+            engine = parse_engine(optarg);
+        else if (opt == 'v' && (strcmp(optarg, "full") == 0 || strcmp(optarg, "local") == 0))
+            verify = strcmp(optarg, "full") == 0? VERIFY_FULL: VERIFY_LOCAL;
+        else if (opt == 'b')
+            benchmark = 1;
+        else if (opt == 'r' && (read_percent = atoi(optarg)) >= 0 && read_percent <= 100)
+            continue;
+        else if (opt == 'z' && (zipf_skew = atof(optarg)) >= 0)
+            continue;
+        else if (opt == 'p')
+            pin_brokers = 1;
+        else if (opt == 'w' && (worker_count = atoi(optarg)) > 0)
+            continue;
+        else if (opt == 'g' && (group_size = atoi(optarg)) > 0 && group_size <= BATCH_STACK)
+            continue;
+        else
+            bad = 1;
+    }
+    if (bad || argc - optind != 3) {
+        fprintf(stderr, "usage: reservations [-e mutex|striped|lockfree] [-v full|local] [-b] [-r read_percent] [-z skew] [-p] [-w workers] [-g group] "
+                "seat_count broker_count xaction_count\n");
         exit(1);
     }
 
-    seat_count = atoi(argv[1]);
-    broker_count = atoi(argv[2]);
-    transaction_count = atoi(argv[3]);
+    seat_count = atoi(argv[optind]);
+    broker_count = atoi(argv[optind + 1]);
+    transaction_count = atoi(argv[optind + 2]);
+    if (seat_count <= 0 || broker_count <= 0) {
+        fprintf(stderr, "reservations: seat_count and broker_count must be positive\n");
+        exit(1);
+    }
+    zipf_span = pow(seat_count + 1.0, 1 - zipf_skew) - 1;
+
+    // Allocate the seat-taken bitmap, whole stripes of it, and the stripes
+    stripe_count = (seat_count + STRIPE_SEATS - 1) / STRIPE_SEATS;
+    seat_taken = aligned_alloc(CACHE_LINE, (size_t)stripe_count * STRIPE_WORDS * sizeof *seat_taken);
+    stripes = aligned_alloc(CACHE_LINE, (size_t)stripe_count * sizeof *stripes);
+    if (seat_taken == NULL || stripes == NULL) {
+        fprintf(stderr, "reservations: out of memory\n");
+        exit(1);
+    }
+    memset(seat_taken, 0, (size_t)stripe_count * STRIPE_WORDS * sizeof *seat_taken);
+    for (int i = 0; i < stripe_count; i++) {
+        memset(&stripes[i], 0, sizeof stripes[i]);
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
 
-    // Allocate the seat-taken array
-    seat_taken = calloc(seat_count, sizeof *seat_taken);
+    // Start the threads the brokers run on; with fewer threads than
+    // brokers, whoever finishes first steals the rest of the work
+    if (worker_count == 0 || worker_count > broker_count)
+        worker_count = broker_count;
+    struct threadpool *pool = threadpool_create(worker_count, pin_brokers? THREADPOOL_PIN: 0);
 
-    // Allocate thread handle array for all brokers
-    pthread_t *thread = calloc(broker_count, sizeof *thread);
+    // Allocate the brokers, each with its own generator
+    struct broker *brokers = calloc(broker_count, sizeof *brokers);
+    void **broker_args = calloc(broker_count, sizeof *broker_args);
+    if (pool == NULL || brokers == NULL || broker_args == NULL) {
+        fprintf(stderr, "reservations: out of memory\n");
+        exit(1);
+    }
+    unsigned long long seed = time(NULL) ^ ((unsigned long long)getpid() << 32);
+    for (int i = 0; i < broker_count; i++) {
+        brokers[i].id = i;
+        seed += 0x9E3779B97F4A7C15ULL;  // splitmix64, so no broker starts at 0 or next to another
+        unsigned long long z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        brokers[i].rng = (z ^ (z >> 31)) | 1;
+        broker_args[i] = brokers + i;
+    }
 
-    // Allocate thread ID array for all brokers
-    int *thread_id = calloc(broker_count, sizeof *thread_id);
+    pthread_t auditor;
+    if (verify == VERIFY_LOCAL)
+        pthread_create(&auditor, NULL, seat_auditor, NULL);
 
-    srand(time(NULL) + getpid());
-    
     // Launch all brokers
-    for (int i = 0; i < broker_count; i++) {
-        thread_id[i] = i;
-        pthread_create(thread + i, NULL, seat_broker, thread_id + i);
+    unsigned long long started = now_ns();
+    if (threadpool_submit_batch(pool, seat_broker, broker_args, broker_count) == -1) {
+        fprintf(stderr, "reservations: out of memory\n");
+        exit(1);
     }
 
     // Wait for all brokers to complete
-    for (int i = 0; i < broker_count; i++)
-        pthread_join(thread[i], NULL);
-}
+    threadpool_wait(pool);
+    unsigned long long wall_ns = now_ns() - started;
+
+    if (verify == VERIFY_LOCAL) {
+        pthread_mutex_lock(&audit_lock);
+        audit_stop = 1;
+        pthread_cond_signal(&audit_wake);
+        pthread_mutex_unlock(&audit_lock);
+        pthread_join(auditor, NULL);
+    }
 
+    if (benchmark)
+        report(brokers, wall_ns);
+    threadpool_free(pool);
+    free(brokers);
+    free(broker_args);
+    free(stripes);
+    free(seat_taken);
+}
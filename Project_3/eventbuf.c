@@ -1,4 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "eventbuf.h"
 
 struct eventbuf_node {
@@ -8,22 +13,310 @@ struct eventbuf_node {
 
 struct eventbuf *eventbuf_create(void)
 {
-    struct eventbuf *eb = malloc(sizeof *eb);
+    struct eventbuf *eb = aligned_alloc(EVENTBUF_CACHE_LINE, sizeof *eb);
 
     if (eb == NULL) return NULL;
 
-    eb->head = eb->tail = NULL;
+    memset(eb, 0, sizeof *eb);  // An empty list; no ring, no slots
+
+    return eb;
+}
+
+static unsigned int round_up(unsigned int capacity)  // To a power of two, so a position maps to a slot with a mask
+{
+    unsigned int size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    return size;
+}
+
+struct eventbuf *eventbuf_create_bounded(unsigned int capacity)
+{
+    if (capacity == 0 || capacity > 1u << 31) return NULL;
+
+    struct eventbuf *eb = eventbuf_create();
+    unsigned int size = round_up(capacity);
+
+    if (eb == NULL) return NULL;
+
+    eb->ring = malloc(size * sizeof *eb->ring);
+
+    if (eb->ring == NULL) {
+        free(eb);
+        return NULL;
+    }
+
+    eb->mask = size - 1;
+
+    return eb;
+}
+
+struct eventbuf *eventbuf_create_mpmc(unsigned int capacity)
+{
+    if (capacity == 0 || capacity > 1u << 30) return NULL;
+
+    struct eventbuf *eb = eventbuf_create();
+    unsigned int size = round_up(capacity < 2? 2: capacity);  // One slot can't tell a full lap from an empty one
+
+    if (eb == NULL) return NULL;
+
+    eb->slots = malloc(size * sizeof *eb->slots);
+
+    if (eb->slots == NULL) {
+        free(eb);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < size; i++)
+        eb->slots[i].seq = i;  // Ready to be written on the first lap
+
+    eb->mask = size - 1;
+    eb->limit = capacity;
 
     return eb;
 }
 
 void eventbuf_free(struct eventbuf *eb)
 {
+    while (eb->ring == NULL && eb->slots == NULL && !eventbuf_empty(eb))  // Any events still in a list
+        eventbuf_get(eb);
+
+    free(eb->ring);
+    free(eb->slots);
     free(eb);
 }
 
+// ------------------- Lock-free -------------------
+
+// A slot whose seq is pos is free for whoever adds at pos; once the event
+// is in, seq becomes pos + 1, which is what whoever gets at pos waits
+// for; and once that's done, seq becomes pos + capacity, ready for the
+// next lap's add. Claiming a slot is a compare-and-swap of the shared
+// position, so only the thread that wins it touches the slot.
+
+// The _many versions claim as many slots in a row as are ready, up to n,
+// and move the position past all of them with the one compare-and-swap.
+// Nobody else can take a slot that's ready for us once we've seen it, so
+// it's still ours when the swap goes through.
+
+// The ring is rounded up to a power of two, so an add also stops at limit
+// events past get_pos. get_pos only moves forward, so a stale look at it
+// can only make us think there's less room than there is.
+
+static int mpmc_add_many(struct eventbuf *eb, const int *events, int n)
+{
+    unsigned int pos = __atomic_load_n(&eb->add_pos, __ATOMIC_RELAXED);
+    int count;
+
+    for (;;) {
+        int diff = 0;
+        int room = (int)(eb->limit - (pos - __atomic_load_n(&eb->get_pos, __ATOMIC_ACQUIRE)));
+        int most = n < room? n: room;
+
+        if (most <= 0) return 0;  // limit events in already: full
+
+        for (count = 0; count < most; count++) {
+            struct eventbuf_slot *slot = &eb->slots[(pos + count) & eb->mask];
+
+            diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + count));
+
+            if (diff != 0) break;
+        }
+
+        if (count > 0) {
+            if (__atomic_compare_exchange_n(&eb->add_pos, &pos, pos + count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;  // Last lap's event is still there: full
+        } else {
+            pos = __atomic_load_n(&eb->add_pos, __ATOMIC_RELAXED);  // Somebody else got it
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct eventbuf_slot *slot = &eb->slots[(pos + i) & eb->mask];
+
+        slot->event = events[i];
+        __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+static int mpmc_get_many(struct eventbuf *eb, int *out, int max)
+{
+    unsigned int pos = __atomic_load_n(&eb->get_pos, __ATOMIC_RELAXED);
+    int count;
+
+    for (;;) {
+        int diff = 0;
+
+        for (count = 0; count < max; count++) {
+            struct eventbuf_slot *slot = &eb->slots[(pos + count) & eb->mask];
+
+            diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + count + 1));
+
+            if (diff != 0) break;
+        }
+
+        if (count > 0) {
+            if (__atomic_compare_exchange_n(&eb->get_pos, &pos, pos + count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return 0;  // Not written yet: empty
+        } else {
+            pos = __atomic_load_n(&eb->get_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct eventbuf_slot *slot = &eb->slots[(pos + i) & eb->mask];
+
+        out[i] = slot->event;
+        __atomic_store_n(&slot->seq, pos + i + eb->mask + 1, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+static void futex_wait(unsigned int *word, unsigned int seen)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// After changing the queue by count events, wake that many sleepers on
+// the other side, if there are any. The fence pairs with the one in
+// wait_for(): either the sleeper sees our change before it sleeps, or we
+// see it waiting.
+static void wake_some(unsigned int *seq, unsigned int *waiters, int count)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0) return;
+
+    __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(seq, count);
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Keep calling try(eb, arg) until it works (0) or the eventbuf is closed
+// (-1). It spins for a while first, since the other side is usually only
+// a moment behind, and then sleeps on seq until somebody bumps it.
+static int wait_for(struct eventbuf *eb, int (*try)(struct eventbuf *, int *), int *arg,
+                    unsigned int *seq, unsigned int *waiters)
+{
+    for (int spin = 0; ; spin++) {
+        if (try(eb, arg) == 0) return 0;
+
+        if (__atomic_load_n(&eb->closed, __ATOMIC_ACQUIRE)) return try(eb, arg);
+
+        if (spin < EVENTBUF_SPINS) {
+            cpu_relax();
+            continue;
+        }
+
+        unsigned int seen = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+
+        __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        int result = try(eb, arg);
+
+        if (result != 0 && !__atomic_load_n(&eb->closed, __ATOMIC_ACQUIRE))
+            futex_wait(seq, seen);  // Returns right away if seq has moved since we looked
+
+        __atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (result == 0) return 0;
+    }
+}
+
+static int try_add_many(struct eventbuf *eb, const int *events, int n)
+{
+    int count = mpmc_add_many(eb, events, n);
+
+    if (count > 0) wake_some(&eb->items_seq, &eb->get_waiters, count);
+
+    return count;
+}
+
+static int try_get_many(struct eventbuf *eb, int *out, int max)
+{
+    int count = mpmc_get_many(eb, out, max);
+
+    if (count > 0) wake_some(&eb->spaces_seq, &eb->add_waiters, count);
+
+    return count;
+}
+
+static int try_add(struct eventbuf *eb, int *event)
+{
+    return try_add_many(eb, event, 1) == 1? 0: -1;
+}
+
+static int try_get(struct eventbuf *eb, int *event)
+{
+    return try_get_many(eb, event, 1) == 1? 0: -1;
+}
+
+int eventbuf_add_wait(struct eventbuf *eb, int event)
+{
+    if (eb->slots == NULL) return eventbuf_add(eb, event);
+
+    if (__atomic_load_n(&eb->closed, __ATOMIC_ACQUIRE)) return -1;
+
+    return wait_for(eb, try_add, &event, &eb->spaces_seq, &eb->add_waiters);
+}
+
+int eventbuf_get_wait(struct eventbuf *eb, int *event)
+{
+    if (eb->slots == NULL) {
+        if (eventbuf_empty(eb)) return -1;
+
+        *event = eventbuf_get(eb);
+        return 0;
+    }
+
+    return wait_for(eb, try_get, event, &eb->items_seq, &eb->get_waiters);
+}
+
+void eventbuf_close(struct eventbuf *eb)
+{
+    __atomic_store_n(&eb->closed, 1, __ATOMIC_SEQ_CST);
+
+    __atomic_fetch_add(&eb->items_seq, 1, __ATOMIC_SEQ_CST);  // Everybody wakes up to find out
+    __atomic_fetch_add(&eb->spaces_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&eb->items_seq, INT_MAX);
+    futex_wake(&eb->spaces_seq, INT_MAX);
+}
+
+// ------------------- Every kind -------------------
+
 int eventbuf_add(struct eventbuf *eb, int event)
 {
+    if (eb->slots != NULL) return try_add(eb, &event);
+
+    if (eb->ring != NULL) {
+        if (eb->write - eb->read > eb->mask) return -1;  // Full
+
+        eb->ring[eb->write++ & eb->mask] = event;
+
+        return 0;
+    }
+
     struct eventbuf_node *node = malloc(sizeof *node);
 
     if (node == NULL) return -1;
@@ -43,6 +336,18 @@ int eventbuf_add(struct eventbuf *eb, int event)
 
 int eventbuf_get(struct eventbuf *eb)
 {
+    if (eb->slots != NULL) {
+        int event;
+
+        return try_get(eb, &event) == 0? event: 0;
+    }
+
+    if (eb->ring != NULL) {
+        if (eb->read == eb->write) return 0;
+
+        return eb->ring[eb->read++ & eb->mask];
+    }
+
     if (eb->head == NULL) return 0;
 
     struct eventbuf_node *node = eb->head;
@@ -57,5 +362,42 @@ int eventbuf_get(struct eventbuf *eb)
 
 int eventbuf_empty(struct eventbuf *eb)
 {
+    if (eb->slots != NULL)  // Only a hint while other threads are at it
+        return __atomic_load_n(&eb->get_pos, __ATOMIC_ACQUIRE) == __atomic_load_n(&eb->add_pos, __ATOMIC_ACQUIRE);
+
+    if (eb->ring != NULL) return eb->read == eb->write;
+
     return eb->head == NULL;
 }
+
+// Add up to n events, as many as fit, without waiting; the bounded kinds
+// stop when they're full. Returns how many went in.
+int eventbuf_add_many(struct eventbuf *eb, const int *events, int n)
+{
+    if (n <= 0) return 0;
+
+    if (eb->slots != NULL) return try_add_many(eb, events, n);
+
+    int count = 0;
+
+    while (count < n && eventbuf_add(eb, events[count]) == 0)
+        count++;
+
+    return count;
+}
+
+// Take up to max events, oldest first, without waiting. Returns how many
+// it got, 0 if the eventbuf was empty.
+int eventbuf_get_many(struct eventbuf *eb, int *out, int max)
+{
+    if (max <= 0) return 0;
+
+    if (eb->slots != NULL) return try_get_many(eb, out, max);
+
+    int count = 0;
+
+    while (count < max && !eventbuf_empty(eb))
+        out[count++] = eventbuf_get(eb);
+
+    return count;
+}
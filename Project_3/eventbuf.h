@@ -5,10 +5,17 @@
  * Functions:
  *
  *   eventbuf_create() -- make a new eventbuf
+ *   eventbuf_create_bounded() -- make a new fixed-size eventbuf
+ *   eventbuf_create_mpmc() -- make a new fixed-size eventbuf for many threads
  *   eventbuf_free()   -- free previously-created eventbuf
  *   eventbuf_add()    -- add an event to the eventbuf
  *   eventbuf_get()    -- remove an event to the eventbuf
  *   eventbuf_empty()  -- true if there are no items in the eventbuf
+ *   eventbuf_add_many() -- add up to n events at once
+ *   eventbuf_get_many() -- remove up to max events at once
+ *   eventbuf_add_wait() -- add an event, waiting for room (mpmc only)
+ *   eventbuf_get_wait() -- remove an event, waiting for one (mpmc only)
+ *   eventbuf_close()  -- wake the waiters; no more events are coming
  *
  * Example Usage:
  *
@@ -28,6 +35,56 @@
  *
  *   eventbuf_free(eb);
  *
+ * Bounded eventbufs
+ *
+ *   eventbuf_create() makes a linked list that grows forever, with a
+ *   malloc() for every event added and a free() for every one taken out.
+ *   eventbuf_create_bounded(capacity) instead keeps the events in one
+ *   ring of slots, allocated up front, so adding and getting never
+ *   allocate. The capacity is rounded up to a power of two. Once the ring
+ *   is full, eventbuf_add() returns -1 until something is taken out.
+ *
+ * Lock-free eventbufs
+ *
+ *   The other kinds need a lock around them as soon as more than one
+ *   thread uses them. eventbuf_create_mpmc(capacity) doesn't: any number
+ *   of threads can add and get at once. It's Dmitry Vyukov's bounded
+ *   queue: every slot has a sequence number that says whether it's
+ *   waiting to be written or to be read for a given lap of the ring, and
+ *   a thread claims a slot by moving the shared position past it with
+ *   one compare-and-swap. Its ring is rounded up too, but it never holds
+ *   more than capacity events.
+ *
+ *   eventbuf_add() and eventbuf_get() never wait; they fail (with -1 and
+ *   0) when the eventbuf is full or empty. eventbuf_add_wait() and
+ *   eventbuf_get_wait() spin for a moment and then sleep on a futex;
+ *   whoever makes room or adds an event only makes the wake-up syscall
+ *   when somebody is actually asleep. After eventbuf_close(),
+ *   eventbuf_get_wait() returns -1 once the eventbuf is empty, and
+ *   eventbuf_add_wait() returns -1 right away.
+ *
+ *   struct eventbuf *eb = eventbuf_create_mpmc(64);
+ *   int event;
+ *
+ *   // Producers:                      // Consumers:
+ *   eventbuf_add_wait(eb, 12);         while (eventbuf_get_wait(eb, &event) == 0)
+ *                                          use(event);
+ *   // When all the producers are done:
+ *   eventbuf_close(eb);
+ *
+ * Batches
+ *
+ *   eventbuf_add_many(eb, events, n) adds as many of the n events as
+ *   fit, in order, and returns how many that was. eventbuf_get_many(eb,
+ *   out, max) takes up to max of the oldest events into out and returns
+ *   how many it got. Neither one waits. On a lock-free eventbuf the
+ *   whole batch is claimed with one compare-and-swap, and on the others
+ *   it all happens inside whatever lock the caller holds, so the cost of
+ *   synchronizing is paid once per batch instead of once per event.
+ *
+ *   int out[16];
+ *   int n = eventbuf_get_many(eb, out, 16);
+ *
  * Compilation instructions
  *
  *   In your Makefile, include this file on the gcc command line. For
@@ -37,14 +94,41 @@
  *   gcc -Wall -Wextra -o foo foo.c eventbuf.c
  */
 
+#define EVENTBUF_CACHE_LINE 64
+#define EVENTBUF_SPINS 100  // Tries before a waiter goes to sleep
+
+struct eventbuf_slot {
+    unsigned int seq;
+    int event;
+};
+
 struct eventbuf {
-    struct eventbuf_node *head, *tail;
+    struct eventbuf_node *head, *tail;  // Unbounded: a linked list
+    int *ring;                          // Bounded: the slots, or NULL for a list
+    struct eventbuf_slot *slots;        // Lock-free: the slots, or NULL
+    unsigned int mask;                  // Capacity - 1
+    unsigned int limit;                 // Lock-free: the capacity asked for, which the ring may be bigger than
+    unsigned int read, write;           // Free-running; the slot is position & mask
+    int closed;
+
+    // Lock-free: producers and consumers each get a cache line
+    unsigned int add_pos __attribute__((aligned(EVENTBUF_CACHE_LINE)));
+    unsigned int spaces_seq, add_waiters;  // Producers sleep on spaces_seq
+    unsigned int get_pos __attribute__((aligned(EVENTBUF_CACHE_LINE)));
+    unsigned int items_seq, get_waiters;   // Consumers sleep on items_seq
 };
 
 struct eventbuf *eventbuf_create(void);
+struct eventbuf *eventbuf_create_bounded(unsigned int capacity);
+struct eventbuf *eventbuf_create_mpmc(unsigned int capacity);
 void eventbuf_free(struct eventbuf *eb);
 int eventbuf_add(struct eventbuf *eb, int val);
 int eventbuf_get(struct eventbuf *eb);
 int eventbuf_empty(struct eventbuf *eb);
+int eventbuf_add_many(struct eventbuf *eb, const int *events, int n);
+int eventbuf_get_many(struct eventbuf *eb, int *out, int max);
+int eventbuf_add_wait(struct eventbuf *eb, int event);
+int eventbuf_get_wait(struct eventbuf *eb, int *event);
+void eventbuf_close(struct eventbuf *eb);
 
 #endif
@@ -4,18 +4,76 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <fcntl.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include "eventbuf.h"
+#include "threadpool.h"
+
+// How producers and consumers keep out of each other's way:
+//
+//   SYNC_NAMED    The original: named semaphores for the mutex, the items,
+//                 and the spaces. Every wait and post goes through the
+//                 kernel's named-semaphore path, and two runs starting at
+//                 once fight over the names.
+//   SYNC_UNNAMED  The same three semaphores, made with sem_init(), so they
+//                 belong to this process alone.
+//   SYNC_CONDVAR  A mutex and two condition variables. The counts live
+//                 under the mutex, and a thread only signals when the
+//                 waiter count says somebody is waiting.
+//   SYNC_MPMC     A lock-free eventbuf that does its own waiting, so
+//                 there's no lock at all.
+//
+// Each backend has a produce function that adds up to want events, waiting
+// for room if there isn't any, and a consume function that gets up to
+// batch events, waiting for some if there aren't any. Both return how many
+// they moved; consume also sets *over once main() says it's all over, which
+// can be on a call that still got some events.
+enum sync_backend { SYNC_NAMED, SYNC_UNNAMED, SYNC_CONDVAR, SYNC_MPMC };
+
+static const char *backend_names[] = { "named", "unnamed", "condvar", "mpmc" };
+
+// Where the "P0: adding event 3" lines go:
+//
+//   LOG_STDIO     Straight to printf(), the original. That puts stdio's
+//                 lock and the terminal inside every critical section.
+//   LOG_BUFFERED  Into a buffer of the thread's own, which goes out with
+//                 one fwrite() when it fills up, outside the lock, and
+//                 when the thread exits. Each thread's lines stay in
+//                 order, but different threads' lines come out in chunks.
+//   LOG_QUIET     Nowhere; main() prints how many events went through.
+enum log_mode { LOG_STDIO, LOG_BUFFERED, LOG_QUIET };
+
+static const char *log_names[] = { "stdio", "buffered", "quiet" };
+
+#define LOG_BUFFER 65536
+#define LOG_LINE_MAX 64  // Longer than any line we print
 
 int producer_count;
 int consumer_count;
 int producer_events_count;
 int outstanding_count;
+enum sync_backend backend = SYNC_UNNAMED;
+int batch = 1;  // Most events moved per trip through the eventbuf
+enum log_mode log_mode = LOG_STDIO;
+long events_added, events_got;  // Totals, added to as each thread exits
+
+__thread char log_buf[LOG_BUFFER];
+__thread int log_len;
 
 sem_t *mutex;
 sem_t *items;
 sem_t *spaces;
+sem_t unnamed_sems[3];  // What they point at for SYNC_UNNAMED
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;  // SYNC_CONDVAR
+pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+int queued;  // Events in the eventbuf
+int producers_waiting, consumers_waiting;
+int done;  // No more events are coming
 
-struct eventbuf *eb;  
+struct eventbuf *eb;
 
 sem_t *sem_open_temp(const char *name, int value)
 {
@@ -34,89 +92,326 @@ sem_t *sem_open_temp(const char *name, int value)
     return sem;
 }
 
-void *producer_run(void *arg) {
-  int *producer_number = arg;
+// Wait for sem once, then take whatever else it has without waiting, up to
+// max in all. Returns how many we took.
+int sem_wait_many(sem_t *sem, int max)
+{
+    int count = 1;
+
+    sem_wait(sem);
+    while (count < max && sem_trywait(sem) == 0)
+        count++;
+
+    return count;
+}
+
+void sem_post_many(sem_t *sem, int count)
+{
+    while (count-- > 0)
+        sem_post(sem);
+}
+
+// Wake up to count of the waiting threads; nobody, without a syscall, if
+// nobody's waiting. Called with the lock held.
+void cond_wake(pthread_cond_t *cond, int waiting, int count)
+{
+    if (waiting == 0)
+        return;
+    if (count >= waiting) {
+        pthread_cond_broadcast(cond);
+        return;
+    }
+    while (count-- > 0)
+        pthread_cond_signal(cond);
+}
+
+void log_flush(void)
+{
+  fwrite(log_buf, 1, log_len, stdout);
+  log_len = 0;
+}
+
+void log_printf(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  if (log_mode == LOG_STDIO) {
+    vprintf(fmt, args);
+  } else if (log_mode == LOG_BUFFERED) {
+    if (LOG_BUFFER - log_len < LOG_LINE_MAX) // Only with batches too big for log_flush_if_full() to keep up
+      log_flush();
+    log_len += vsnprintf(log_buf + log_len, LOG_BUFFER - log_len, fmt, args);
+  }
+  va_end(args);
+}
+
+void log_flush_if_full(void) // Between batches, so the fwrite() isn't holding anybody up
+{
+  if (log_mode == LOG_BUFFERED && log_len > LOG_BUFFER / 2)
+    log_flush();
+}
+
+// ------------------- Semaphores -------------------
+
+int sem_produce(int producer_number, int *events, int want)
+{
+  int count = sem_wait_many(spaces, want); // Wait to see if there's enough space in the event buffer to post.
+  sem_wait(mutex); // Lock a mutex around the eventbuf.
+  for (int j = 0; j < count; j++)
+    log_printf("P%d: adding event %d\n", producer_number, events[j]); // Print that it's adding the event, along with the event number. This should match the sample output, above.
+  eventbuf_add_many(eb, events, count); // Add the events to the eventbuf; the spaces we took guarantee room.
+  sem_post(mutex); // Unlock the mutex.
+  sem_post_many(items, count); // Signal waiting consumer threads that there are events to be consumed.
+  return count;
+}
+
+int sem_consume(int consumer_number, int *events, int *over)
+{
+  int count = sem_wait_many(items, batch); // Wait to see if a producer has put anything in the buffer.
+  sem_wait(mutex); // Lock a mutex around the eventbuf.
+  int got = eventbuf_get_many(eb, events, count); // Get as many events as we took items.
+  for (int j = 0; j < got; j++)
+    log_printf("C%d: got event %d\n", consumer_number, events[j]); // Print a message about the event being received. This should match the sample output, above.
+  sem_post(mutex); // Unlock the mutex
+  sem_post_many(spaces, got); // Post to the semaphore indicating that there are now free spaces for producers to put events into.
+  if (got < count) { // Some of our items were the ones main() posts when it's all over, so we're done.
+    sem_post_many(items, count - got - 1); // Keep one for ourselves and leave the rest for the other consumers.
+    *over = 1;
+  }
+  return got;
+}
+
+// ------------------- Condition variables -------------------
+
+int condvar_produce(int producer_number, int *events, int want)
+{
+  pthread_mutex_lock(&lock);
+  while (queued == outstanding_count) {
+    producers_waiting++;
+    pthread_cond_wait(&not_full, &lock);
+    producers_waiting--;
+  }
+  int count = outstanding_count - queued < want? outstanding_count - queued: want;
+  for (int j = 0; j < count; j++)
+    log_printf("P%d: adding event %d\n", producer_number, events[j]);
+  eventbuf_add_many(eb, events, count);
+  queued += count;
+  cond_wake(&not_empty, consumers_waiting, count);
+  pthread_mutex_unlock(&lock);
+  return count;
+}
 
-  for (int i = 0; i < producer_events_count; i++) { // Wait to see if there's enough space in the event buffer to post.
-    int event = *producer_number * 100 + i; 
-    sem_wait(spaces);
-    sem_wait(mutex); // Lock a mutex around the eventbuf.
-    printf("P%d: adding event %d\n",*producer_number, event); // Print that it's adding the event, along with the event number. This should match the sample output, above.
-    eventbuf_add(eb, event); // Add an event to the eventbuf.
-    sem_post(mutex); // Unlock the mutex.
-    sem_post(items); // Signal waiting consumer threads that there is an event to be consumed.
+int condvar_consume(int consumer_number, int *events, int *over)
+{
+  pthread_mutex_lock(&lock);
+  while (queued == 0 && !done) {
+    consumers_waiting++;
+    pthread_cond_wait(&not_empty, &lock);
+    consumers_waiting--;
   }
-  printf("P%d: exiting", *producer_number);
-  return NULL;
+  int got = eventbuf_get_many(eb, events, batch); // None only when we're done
+  *over = got == 0;
+  for (int j = 0; j < got; j++)
+    log_printf("C%d: got event %d\n", consumer_number, events[j]);
+  queued -= got;
+  cond_wake(&not_full, producers_waiting, got);
+  pthread_mutex_unlock(&lock);
+  return got;
 }
 
-void *consumer_run(void *arg) {
-  int *consumer_number = arg;
+// ------------------- Lock-free -------------------
+
+int mpmc_produce(int producer_number, int *events, int want)
+{
+  int count = eventbuf_add_many(eb, events, want); // What doesn't fit goes in the next batch
+  if (count == 0) { // Full: sleep until there's room for one, then go back to batches
+    eventbuf_add_wait(eb, events[0]);
+    count = 1;
+  }
+  for (int j = 0; j < count; j++)
+    log_printf("P%d: adding event %d\n", producer_number, events[j]);
+  return count;
+}
 
-  while(1) { // Wait to see if a producer has put anything in the buffer.
-    sem_wait(items);
-    sem_wait(mutex); // Lock a mutex around the eventbuf.
-    if(eventbuf_empty(eb)) { // Check to see if the eventbuf is empty.
-      sem_post(mutex); // If it is, we're done and it's time to exit our loop. Be sure to unlock the mutex first.
-      printf("C%d: exiting\n", *consumer_number);
-      break;
+int mpmc_consume(int consumer_number, int *events, int *over)
+{
+  int got = eventbuf_get_many(eb, events, batch);
+  if (got == 0) { // Empty: sleep until there's one, or until the eventbuf is closed and empty
+    if (eventbuf_get_wait(eb, &events[0]) == -1) {
+      *over = 1;
+      return 0;
     }
-    int event = eventbuf_get(eb);// Since the eventbuf wasn't empty, get an event from it.
-    printf("C%d: got event %d\n", *consumer_number, event); // Print a message about the event being received. This should match the sample output, above.
-    sem_post(mutex); // Unlock the mutex
-    sem_post(spaces); // If we're not done, post to the semaphore indicating that there are now free spaces for producers to put events into.
+    got = 1;
+  }
+  for (int j = 0; j < got; j++)
+    log_printf("C%d: got event %d\n", consumer_number, events[j]);
+  return got;
+}
+
+int produce(int producer_number, int *events, int want)
+{
+  switch (backend) {
+  case SYNC_CONDVAR:
+    return condvar_produce(producer_number, events, want);
+  case SYNC_MPMC:
+    return mpmc_produce(producer_number, events, want);
+  default:
+    return sem_produce(producer_number, events, want);
+  }
+}
+
+int consume(int consumer_number, int *events, int *over)
+{
+  switch (backend) {
+  case SYNC_CONDVAR:
+    return condvar_consume(consumer_number, events, over);
+  case SYNC_MPMC:
+    return mpmc_consume(consumer_number, events, over);
+  default:
+    return sem_consume(consumer_number, events, over);
   }
-  return NULL;
+}
+
+void producer_run(void *arg) {
+  int producer_number = (intptr_t)arg;
+  int *events = calloc(batch, sizeof *events);
+
+  for (int i = 0; i < producer_events_count; ) {
+    int want = producer_events_count - i < batch? producer_events_count - i: batch;
+    for (int j = 0; j < want; j++)
+      events[j] = producer_number * 100 + i + j;
+    i += produce(producer_number, events, want);
+    log_flush_if_full();
+  }
+  log_printf("P%d: exiting", producer_number);
+  log_flush();
+  __atomic_fetch_add(&events_added, producer_events_count, __ATOMIC_RELAXED);
+  free(events);
+}
+
+void consumer_run(void *arg) {
+  int consumer_number = (intptr_t)arg;
+  int *events = calloc(batch, sizeof *events);
+
+  long got = 0;
+  int over = 0;
+
+  while (!over) { // Until we're told it's all over
+    got += consume(consumer_number, events, &over);
+    log_flush_if_full();
+  }
+  log_printf("C%d: exiting\n", consumer_number);
+  log_flush();
+  __atomic_fetch_add(&events_got, got, __ATOMIC_RELAXED);
+  free(events);
 }
 
 int main(int argc, char *argv[])
 {
   // Parse command line
-  if (argc != 5) {
-      fprintf(stderr, "usage: producer_count consumer_count producer_events_count outstanding_count\n");
+  int opt, bad = 0;
+  while ((opt = getopt(argc, argv, "s:b:l:")) != -1) {
+    if (opt == 'b' && atoi(optarg) > 0) {
+      batch = atoi(optarg);
+    } else if (opt == 's') {
+      unsigned int b = 0;
+      while (b < sizeof backend_names / sizeof backend_names[0] && strcmp(optarg, backend_names[b]) != 0)
+        b++;
+      if (b == sizeof backend_names / sizeof backend_names[0])
+        bad = 1;
+      backend = b;
+    } else if (opt == 'l') {
+      unsigned int l = 0;
+      while (l < sizeof log_names / sizeof log_names[0] && strcmp(optarg, log_names[l]) != 0)
+        l++;
+      if (l == sizeof log_names / sizeof log_names[0])
+        bad = 1;
+      log_mode = l;
+    } else {
+      bad = 1;
+    }
+  }
+  if (bad || argc - optind != 4) {
+      fprintf(stderr, "usage: [-s named|unnamed|condvar|mpmc] [-b batch] [-l stdio|buffered|quiet] producer_count consumer_count producer_events_count outstanding_count\n");
       exit(1);
   }
 
-  producer_count = atoi(argv[1]);
-  consumer_count = atoi(argv[2]);
-  producer_events_count = atoi(argv[3]);
-  outstanding_count = atoi(argv[4]);
+  producer_count = atoi(argv[optind]);
+  consumer_count = atoi(argv[optind + 1]);
+  producer_events_count = atoi(argv[optind + 2]);
+  outstanding_count = atoi(argv[optind + 3]);
 
-  eb = eventbuf_create(); // Create the event buffer
-  mutex = sem_open_temp("mutex_sem", 1);
-  items = sem_open_temp("items_sem", 0);
-  spaces = sem_open_temp("spaces_sem", outstanding_count);
+  if (backend == SYNC_MPMC)
+    eb = eventbuf_create_mpmc(outstanding_count); // It holds no more than outstanding_count by itself
+  else
+    eb = eventbuf_create_bounded(outstanding_count); // Create the event buffer; the backend never lets it hold more than this
+  if (eb == NULL) {
+      fprintf(stderr, "pcseml: outstanding_count must be positive\n");
+      exit(1);
+  }
 
-  pthread_t *producer_thread = calloc(producer_count, sizeof *producer_thread);
-  int *producer_thread_id = calloc(producer_count, sizeof *producer_thread_id);
-  pthread_t *consumer_thread = calloc(consumer_count, sizeof *consumer_thread);
-  int *consumer_thread_id = calloc(consumer_count, sizeof *consumer_thread_id);
+  if (backend == SYNC_NAMED) {
+    mutex = sem_open_temp("mutex_sem", 1);
+    items = sem_open_temp("items_sem", 0);
+    spaces = sem_open_temp("spaces_sem", outstanding_count);
+    if (mutex == SEM_FAILED || items == SEM_FAILED || spaces == SEM_FAILED) {
+      perror("pcseml: sem_open");
+      exit(1);
+    }
+  } else if (backend == SYNC_UNNAMED) {
+    mutex = &unnamed_sems[0];
+    items = &unnamed_sems[1];
+    spaces = &unnamed_sems[2];
+    if (sem_init(mutex, 0, 1) == -1 || sem_init(items, 0, 0) == -1 || sem_init(spaces, 0, outstanding_count) == -1) {
+      perror("pcseml: sem_init");
+      exit(1);
+    }
+  }
 
-  for (int i = 0; i < producer_count; i++){   // Start the correct number of producer threads
-    producer_thread_id[i] = i;
-    pthread_create(producer_thread + i, NULL, producer_run, producer_thread_id + i); // Each thread will be passed a pointer to an int, its ID number
+  // Producers and consumers each get a pool with a thread apiece, since
+  // they block waiting for each other; then main() can wait for just the
+  // producers before it tells the consumers to stop.
+  struct threadpool *producers = threadpool_create(producer_count > 0? producer_count: 1, 0);
+  struct threadpool *consumers = threadpool_create(consumer_count > 0? consumer_count: 1, 0);
+  if (producers == NULL || consumers == NULL) {
+      fprintf(stderr, "pcseml: can't start threads\n");
+      exit(1);
   }
-  
 
+  for (int i = 0; i < producer_count; i++)   // Start the correct number of producers
+    threadpool_submit(producers, producer_run, (void *)(intptr_t)i); // Each one is passed its ID number
 
-  for (int i = 0; i < consumer_count; i++){   // Start the correct number of consumer threads
-    consumer_thread_id[i] = i;
-    pthread_create(consumer_thread + i, NULL, consumer_run, consumer_thread_id + i); // Each thread will be passed a pointer to an int, its ID number
-  }
+  for (int i = 0; i < consumer_count; i++)   // Start the correct number of consumers
+    threadpool_submit(consumers, consumer_run, (void *)(intptr_t)i);
 
+  threadpool_wait(producers);   // Wait for all producers to complete
 
-  for (int i = 0; i < producer_count; i++) {   // Wait for all producer threads to complete
-    pthread_join(producer_thread[i], NULL);
+  // Notify all the consumer threads that they're done
+  if (backend == SYNC_MPMC) {
+    eventbuf_close(eb);
+  } else if (backend == SYNC_CONDVAR) {
+    pthread_mutex_lock(&lock);
+    done = 1;
+    pthread_cond_broadcast(&not_empty);
+    pthread_mutex_unlock(&lock);
+  } else {
+    sem_post_many(items, consumer_count);
   }
 
-  for (int i = 0; i < consumer_count; i++) {   // Notify all the consumer threads that they're done
-    sem_post(items);
-  }
+  threadpool_wait(consumers);  // Wait for all consumers to complete
+
+  if (log_mode == LOG_QUIET)
+    printf("pcseml: %s: %d producers added %ld events, %d consumers got %ld events\n", backend_names[backend],
+           producer_count, events_added, consumer_count, events_got);
 
-  for (int i = 0; i < consumer_count; i++) {  // Wait for all consumer threads to complete
-    pthread_join(consumer_thread[i], NULL);
+  if (backend == SYNC_UNNAMED) {
+    for (int i = 0; i < 3; i++)
+      sem_destroy(&unnamed_sems[i]);
   }
 
   eventbuf_free(eb); // Free the event buffer
+  threadpool_free(producers);
+  threadpool_free(consumers);
   return 1;
 }
@@ -0,0 +1,483 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define AIO_HAVE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE  // <linux/fs.h> comes along and has its own
+#endif
+#endif
+
+#include "aio.h"
+#include "threadpool.h"
+#include "block.h"
+#include "bcache.h"
+#include "image.h"
+#include "journal.h"
+
+// ----------Asynchronous Block Reads-------------------------------------------------------------------------------------------
+
+  // bread() makes its thread wait for every block it reads. bread_async()
+  // just queues the read: bsubmit() starts everything queued, and bwait()
+  // waits for all of it to finish, calling each read's callback as it does.
+  // Callbacks only ever run inside bwait(), on the thread that queued them.
+
+  // Each thread has its own queue. On Linux it's backed by an io_uring, so a
+  // whole batch of reads goes to the kernel in one system call and they all
+  // run at once. If there's no io_uring (old kernel, or it's blocked) a small
+  // pool of threads does the pread()s instead.
+
+  // Reads see the buffer cache the way bread_range() does: a cached block
+  // (dirty or not) is copied from the cache right away, everything else
+  // comes from the image.
+
+int aio_use_uring = 1;  // Set to 0 before a thread's first bread_async() to make it use the pool
+
+struct aio_request {
+  int block_num;
+  unsigned char *buf;
+  bio_callback callback;
+  void *arg;
+  int result;
+  unsigned int checkpoints;  // journal_checkpoints when it was queued
+  struct iovec iov;
+  struct aio_context *ctx;
+  struct aio_request *next;
+};
+
+struct aio_context {
+  struct aio_request *queued, **queued_tail;  // Waiting for bsubmit()
+  struct aio_request *done;                   // Finished, waiting for bwait() to call back
+  int in_flight;                              // Submitted or done, not yet called back
+  pthread_mutex_t lock;                       // The pool workers touch done and in_flight
+  pthread_cond_t finished;
+#ifdef AIO_HAVE_URING
+  int ring_fd;  // -1 when we're using the pool
+  unsigned int ring_entries;
+  unsigned int in_ring;  // Submitted to the ring and not yet reaped
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+#endif
+};
+
+static void finish(struct aio_request *req) {  // Hand a request back to bwait()
+  struct aio_context *ctx = req->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  req->next = ctx->done;
+  ctx->done = req;
+  pthread_cond_signal(&ctx->finished);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+// ----------io_uring-------------------------------------------------------------------------------------------
+
+  // There's no liburing to lean on, so this talks to the kernel directly:
+  // map the two rings, put READV entries on the submission ring, and pick
+  // results off the completion ring.
+
+#ifdef AIO_HAVE_URING
+static int ring_setup(struct aio_context *ctx) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  int fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p);
+  if (fd < 0) {
+    return -1;
+  }
+  ctx->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ctx->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {  // Both rings live in one mapping
+    if (ctx->cq_ring_size > ctx->sq_ring_size) {
+      ctx->sq_ring_size = ctx->cq_ring_size;
+    }
+    ctx->cq_ring_size = ctx->sq_ring_size;
+  }
+  ctx->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ctx->sq_ring == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  ctx->cq_ring = ctx->sq_ring;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ctx->cq_ring == MAP_FAILED || ctx->sqes == MAP_FAILED) {
+    if (ctx->cq_ring != MAP_FAILED && ctx->cq_ring != ctx->sq_ring) {
+      munmap(ctx->cq_ring, ctx->cq_ring_size);
+    }
+    if (ctx->sqes != MAP_FAILED) {
+      munmap(ctx->sqes, ctx->sqes_size);
+    }
+    munmap(ctx->sq_ring, ctx->sq_ring_size);
+    close(fd);
+    return -1;
+  }
+
+  unsigned char *sq = ctx->sq_ring, *cq = ctx->cq_ring;
+  ctx->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ctx->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ctx->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  ctx->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ctx->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ctx->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ctx->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  ctx->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ctx->ring_entries = p.sq_entries;
+  ctx->ring_fd = fd;
+  return 0;
+}
+
+static void ring_teardown(struct aio_context *ctx) {
+  munmap(ctx->sqes, ctx->sqes_size);
+  if (ctx->cq_ring != ctx->sq_ring) {
+    munmap(ctx->cq_ring, ctx->cq_ring_size);
+  }
+  munmap(ctx->sq_ring, ctx->sq_ring_size);
+  close(ctx->ring_fd);
+}
+
+static int ring_submit(struct aio_context *ctx) {  // Move queued requests onto the ring, as many as fit
+  unsigned int tail = *ctx->sq_tail;
+  unsigned int added = 0;
+  while (ctx->queued != NULL && ctx->in_ring + added < ctx->ring_entries) {
+    struct aio_request *req = ctx->queued;
+    ctx->queued = req->next;
+    unsigned int index = (tail + added) & *ctx->sq_mask;
+    struct io_uring_sqe *sqe = &ctx->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = image_fd;
+    sqe->off = (uint64_t)req->block_num * BLOCK_SIZE;
+    sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    ctx->sq_array[index] = index;
+    added++;
+  }
+  if (ctx->queued == NULL) {
+    ctx->queued_tail = &ctx->queued;
+  }
+  if (added == 0) {
+    return 0;
+  }
+  __atomic_store_n(ctx->sq_tail, tail + added, __ATOMIC_RELEASE);
+  ctx->in_ring += added;
+  unsigned int unsubmitted = tail + added - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);  // Including any an earlier failed enter left behind
+  if (syscall(__NR_io_uring_enter, ctx->ring_fd, unsubmitted, 0, 0, NULL, 0) < 0) {
+    return -1;  // They're still on the ring; the next enter picks them up
+  }
+  return 0;
+}
+
+static void ring_reap(struct aio_context *ctx, int wait) {  // Move finished reads to the done list
+  if (wait && ctx->in_ring > 0) {
+    unsigned int unsubmitted = *ctx->sq_tail - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+    syscall(__NR_io_uring_enter, ctx->ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  }
+  unsigned int head = *ctx->cq_head;
+  while (head != __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask];
+    struct aio_request *req = (struct aio_request *)(uintptr_t)cqe->user_data;
+    int redo = cqe->res != BLOCK_SIZE;  // Short (the end of the image) or failed; let image_read() sort it out
+    if (!redo) {
+      journal_read_begin();
+      redo = req->checkpoints != journal_checkpoints;  // The kernel may have read from before one, and the patches are gone
+      if (!redo) {
+        journal_patch(req->block_num, 1, req->buf);  // What image_read() would have done
+      }
+      journal_read_end();
+    }
+    req->result = redo? image_read(req->block_num, 1, req->buf): 0;
+    head++;
+    ctx->in_ring--;
+    finish(req);
+  }
+  __atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// ----------Thread Pool-------------------------------------------------------------------------------------------
+
+  // The fallback: AIO_THREADS workers from the shared threadpool doing
+  // plain image_read()s, one task per request. The pool is started the
+  // first time anybody needs it and stays around.
+
+static struct threadpool *pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_read(void *arg) {
+  struct aio_request *req = arg;
+  req->result = image_read(req->block_num, 1, req->buf);
+  finish(req);
+}
+
+static void pool_start(void) {
+  pool = threadpool_create(AIO_THREADS, 0);
+}
+
+static int pool_submit(struct aio_context *ctx) {
+  if (ctx->queued == NULL) {
+    return 0;
+  }
+  pthread_once(&pool_once, pool_start);
+  while (ctx->queued != NULL) {  // In batches, so one wakeup covers many
+    void *batch[AIO_QUEUE_DEPTH];
+    int n = 0;
+    for (; ctx->queued != NULL && n < AIO_QUEUE_DEPTH; n++) {
+      batch[n] = ctx->queued;
+      ctx->queued = ctx->queued->next;
+    }
+    if (pool == NULL || threadpool_submit_batch(pool, pool_read, batch, n) == -1) {
+      for (int i = 0; i < n; i++) {  // No workers; do them here rather than not at all
+        pool_read(batch[i]);
+      }
+    }
+  }
+  ctx->queued_tail = &ctx->queued;
+  return 0;
+}
+
+// ----------Per-thread Queues-------------------------------------------------------------------------------------------
+
+static pthread_key_t context_key;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+
+static int using_ring(struct aio_context *ctx) {
+#ifdef AIO_HAVE_URING
+  return ctx->ring_fd != -1;
+#else
+  (void)ctx;
+  return 0;
+#endif
+}
+
+static int submit(struct aio_context *ctx) {
+#ifdef AIO_HAVE_URING
+  if (using_ring(ctx)) {
+    return ring_submit(ctx);  // Whatever doesn't fit waits for bwait() to make room
+  }
+#endif
+  return pool_submit(ctx);
+}
+
+static void context_free(void *p) {  // At thread exit. Anything still in flight is waited for, not called back
+  struct aio_context *ctx = p;
+  submit(ctx);
+  pthread_mutex_lock(&ctx->lock);
+  while (ctx->in_flight > 0) {
+    while (ctx->done != NULL) {
+      struct aio_request *req = ctx->done;
+      ctx->done = req->next;
+      ctx->in_flight--;
+      free(req);
+    }
+#ifdef AIO_HAVE_URING
+    if (using_ring(ctx)) {
+      pthread_mutex_unlock(&ctx->lock);
+      ring_reap(ctx, 1);
+      ring_submit(ctx);
+      pthread_mutex_lock(&ctx->lock);
+      continue;
+    }
+#endif
+    if (ctx->in_flight > 0 && ctx->done == NULL) {
+      pthread_cond_wait(&ctx->finished, &ctx->lock);
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+#ifdef AIO_HAVE_URING
+  if (ctx->ring_fd != -1) {
+    ring_teardown(ctx);
+  }
+#endif
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->finished);
+  free(ctx);
+}
+
+static void context_key_create(void) {
+  pthread_key_create(&context_key, context_free);
+}
+
+static struct aio_context *get_context(void) {
+  pthread_once(&context_once, context_key_create);
+  struct aio_context *ctx = pthread_getspecific(context_key);
+  if (ctx != NULL) {
+    return ctx;
+  }
+  ctx = calloc(1, sizeof *ctx);
+  if (ctx == NULL) {
+    return NULL;
+  }
+  ctx->queued_tail = &ctx->queued;
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->finished, NULL);
+#ifdef AIO_HAVE_URING
+  ctx->ring_fd = -1;
+  if (aio_use_uring) {
+    ring_setup(ctx);  // Just leaves ring_fd at -1 if it doesn't work
+  }
+#endif
+  pthread_setspecific(context_key, ctx);
+  return ctx;
+}
+
+// ----------The Interface-------------------------------------------------------------------------------------------
+
+// Queue a read of block_num into buf (BLOCK_SIZE bytes, left alone until
+// the callback runs). callback gets a result of 0, or -1 if the read failed.
+// Returns -1 without queueing anything if we're out of memory.
+int bread_async(int block_num, unsigned char *buf, bio_callback callback, void *arg) {
+  struct aio_context *ctx = get_context();
+  struct aio_request *req = malloc(sizeof *req);
+  if (ctx == NULL || req == NULL) {
+    free(req);
+    return -1;
+  }
+  req->block_num = block_num;
+  req->buf = buf;
+  req->callback = callback;
+  req->arg = arg;
+  req->checkpoints = __atomic_load_n(&journal_checkpoints, __ATOMIC_ACQUIRE);  // Before the kernel reads anything
+  req->iov.iov_base = buf;
+  req->iov.iov_len = BLOCK_SIZE;
+  req->ctx = ctx;
+  req->next = NULL;
+  ctx->in_flight++;  // Only this thread touches it while the request isn't out yet
+
+  int hit = 0;
+  if (image_map != NULL) {  // Nothing to wait for
+    req->result = image_read(block_num, 1, buf);
+    hit = 1;
+  }
+  else {
+    bcache_lock();
+    struct buf *b = bcache_peek(block_num);
+    if (b != NULL) {
+      memcpy(buf, b->data, BLOCK_SIZE);
+      req->result = 0;
+      hit = 1;
+    }
+    bcache_unlock();
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  if (hit) {
+    req->next = ctx->done;
+    ctx->done = req;
+  }
+  else {
+    *ctx->queued_tail = req;
+    ctx->queued_tail = &req->next;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+int bsubmit(void) {  // Start every read this thread has queued
+  struct aio_context *ctx = get_context();
+  if (ctx == NULL) {
+    return -1;
+  }
+  return submit(ctx);
+}
+
+// Wait for every read this thread has queued (submitting any that aren't
+// out yet) and call their callbacks. Returns 0, or -1 if any read failed.
+int bwait(void) {
+  struct aio_context *ctx = get_context();
+  if (ctx == NULL) {
+    return -1;
+  }
+  int failed = 0;
+  submit(ctx);
+  pthread_mutex_lock(&ctx->lock);
+  while (ctx->in_flight > 0) {
+    if (ctx->done == NULL) {
+      if (using_ring(ctx)) {
+#ifdef AIO_HAVE_URING
+        pthread_mutex_unlock(&ctx->lock);
+        ring_reap(ctx, 1);
+        ring_submit(ctx);  // Room on the ring now for anything left over
+        pthread_mutex_lock(&ctx->lock);
+#endif
+      }
+      else {
+        pthread_cond_wait(&ctx->finished, &ctx->lock);
+      }
+      continue;
+    }
+    struct aio_request *req = ctx->done;
+    ctx->done = req->next;
+    ctx->in_flight--;
+    pthread_mutex_unlock(&ctx->lock);  // The callback may well queue more
+
+    failed |= req->result == -1;
+    if (req->callback != NULL) {
+      req->callback(req->block_num, req->buf, req->result, req->arg);
+    }
+    free(req);
+    pthread_mutex_lock(&ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return failed? -1: 0;
+}
+
+// ----------Readahead-------------------------------------------------------------------------------------------
+
+  // breadahead() starts reading a block we expect to want soon into the
+  // buffer cache, so the bread() or bget() that wants it later is a hit.
+  // The block lands in the cache at the next bwait(); see bcache_install()
+  // for why an old read never replaces a newer write.
+
+struct readahead {
+  unsigned int generation;  // Don't install a block from some other image
+  unsigned int since;
+  unsigned char data[BLOCK_SIZE];
+};
+
+static void readahead_done(int block_num, unsigned char *buf, int result, void *arg) {
+  struct readahead *ra = arg;
+  (void)buf;
+  if (result == 0 && ra->generation == image_generation) {
+    bcache_lock();
+    bcache_install(block_num, ra->data, ra->since);
+    bcache_unlock();
+  }
+  free(ra);
+}
+
+void breadahead(int block_num) {
+  if (image_map != NULL) {
+    return;  // The mapping is already as close as it gets
+  }
+  bcache_lock();
+  int cached = bcache_peek(block_num) != NULL;
+  unsigned int since = bcache_clock();
+  bcache_unlock();
+  if (cached) {
+    return;
+  }
+  struct readahead *ra = malloc(sizeof *ra);
+  if (ra == NULL) {
+    return;
+  }
+  ra->generation = image_generation;
+  ra->since = since;
+  if (bread_async(block_num, ra->data, readahead_done, ra) == -1) {
+    free(ra);
+  }
+}
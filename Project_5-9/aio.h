@@ -0,0 +1,16 @@
+#ifndef AIO_H
+#define AIO_H
+
+#define AIO_QUEUE_DEPTH 64  // io_uring submission queue entries per thread
+#define AIO_THREADS 4       // Workers for the thread pool when there's no io_uring
+
+typedef void (*bio_callback)(int block_num, unsigned char *buf, int result, void *arg);
+
+int bread_async(int block_num, unsigned char *buf, bio_callback callback, void *arg);
+int bsubmit(void);
+int bwait(void);
+void breadahead(int block_num);
+
+extern int aio_use_uring;
+
+#endif
@@ -0,0 +1,204 @@
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "bcache.h"
+#include "image.h"
+#include "stats.h"
+
+// ----------Buffer Cache-------------------------------------------------------------------------------------------
+
+  // Every bread()/bwrite() used to go straight to the image. The hot metadata
+  // blocks (the free maps and the inode blocks) got read over and over.
+
+  // Now there's a fixed pool of BCACHE_BLOCKS buffers in front of the image.
+  // A buffer is found by hashing its block number, and the least recently
+  // used one is recycled when we need room. Writes just mark the buffer
+  // dirty; it only goes to disk when it's evicted or on bcache_sync().
+
+  // One mutex covers the hash, the LRU and the buffers' contents. block.c
+  // holds it across a lookup and the copy in or out, so a buffer can't be
+  // recycled in between. A pinned buffer is safe to read without it.
+
+static struct buf bufs[BCACHE_BLOCKS];
+static struct buf *hash[BCACHE_HASH_SIZE];
+static struct buf lru;  // Sentinel: lru.lru_next is the most recently used, lru.lru_prev the least
+static int initialized = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int write_clock;  // Ticks on every write that goes through the block layer
+static unsigned int last_write[BCACHE_HASH_SIZE];  // write_clock of the latest write per hash slot
+
+void bcache_lock(void) {
+  pthread_mutex_lock(&cache_mutex);
+}
+
+void bcache_unlock(void) {
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+static int hash_index(int block_num) {
+  return block_num & (BCACHE_HASH_SIZE - 1);
+}
+
+static void lru_unlink(struct buf *b) {
+  b->lru_prev->lru_next = b->lru_next;
+  b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_front(struct buf *b) {
+  b->lru_next = lru.lru_next;
+  b->lru_prev = &lru;
+  lru.lru_next->lru_prev = b;
+  lru.lru_next = b;
+}
+
+static void hash_remove(struct buf *b) {
+  struct buf **p = &hash[hash_index(b->block_num)];
+  while (*p != NULL) {
+    if (*p == b) {
+      *p = b->hash_next;
+      break;
+    }
+    p = &(*p)->hash_next;
+  }
+  b->hash_next = NULL;
+}
+
+static void hash_insert(struct buf *b) {
+  int i = hash_index(b->block_num);
+  b->hash_next = hash[i];
+  hash[i] = b;
+}
+
+static struct buf *hash_lookup(int block_num) {
+  for (struct buf *b = hash[hash_index(block_num)]; b != NULL; b = b->hash_next) {
+    if (b->block_num == block_num) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+static int buf_flush(struct buf *b) {
+  if (!b->valid || !b->dirty) {
+    return 0;
+  }
+  if (image_write(b->block_num, 1, b->data) == -1) {
+    return -1;
+  }
+  b->dirty = 0;
+  return 0;
+}
+
+static void reset(void) {
+  lru.lru_next = lru.lru_prev = &lru;
+  for (int i = 0; i < BCACHE_HASH_SIZE; i++) {
+    hash[i] = NULL;
+  }
+  for (int i = 0; i < BCACHE_BLOCKS; i++) {
+    bufs[i].valid = 0;
+    bufs[i].dirty = 0;
+    bufs[i].pins = 0;
+    bufs[i].hash_next = NULL;
+    lru_push_front(&bufs[i]);
+  }
+  initialized = 1;
+}
+
+void bcache_reset(void) {  // Drop everything without writing it. image_open()/image_close() use this.
+  bcache_lock();
+  reset();
+  bcache_unlock();
+}
+
+// Return the cached buffer for block_num, moving it to the front of the LRU.
+// On a miss the least recently used buffer is written back if dirty and
+// reused. If fill is set it is read in from the image; callers about to
+// overwrite the whole block pass 0 to skip that read.
+struct buf *bcache_get(int block_num, int fill) {
+  if (!initialized) {
+    reset();
+  }
+
+  struct buf *b = hash_lookup(block_num);
+  if (b != NULL) {
+    STAT_COUNT(STAT_CACHE_HIT, 1);
+    lru_unlink(b);
+    lru_push_front(b);
+    return b;
+  }
+
+  STAT_COUNT(STAT_CACHE_MISS, 1);
+  b = lru.lru_prev;  // Least recently used that nobody has borrowed
+  while (b != &lru && b->pins > 0) {
+    b = b->lru_prev;
+  }
+  if (b == &lru) {
+    return NULL;  // Every buffer is pinned
+  }
+  if (buf_flush(b) == -1) {
+    return NULL;
+  }
+  if (b->valid) {
+    hash_remove(b);
+  }
+  b->valid = 0;
+  b->block_num = block_num;
+  if (fill && image_read(block_num, 1, b->data) == -1) {
+    return NULL;
+  }
+  b->valid = 1;
+  hash_insert(b);
+  lru_unlink(b);
+  lru_push_front(b);
+  return b;
+}
+
+struct buf *bcache_peek(int block_num) {  // Cached buffer for block_num or NULL; never does I/O or touches the LRU
+  if (!initialized) {
+    return NULL;
+  }
+  return hash_lookup(block_num);
+}
+
+// ----------Installing blocks read elsewhere-------------------------------------------------------------------------------------------
+
+  // Readahead reads blocks into its own buffers while nobody holds the lock,
+  // then puts them in the cache when they arrive. A block written in the
+  // meantime must not be replaced by what was read before the write, so
+  // the block layer notes every write, and bcache_install() refuses blocks
+  // written since the read was started. Writes are tracked per hash slot,
+  // so a write to some other block now and then costs us a readahead, never
+  // correctness. All three are called with bcache_lock() held.
+
+unsigned int bcache_clock(void) {  // Read this before starting the read you'll install
+  return write_clock;
+}
+
+void bcache_note_write(int block_num) {
+  last_write[hash_index(block_num)] = ++write_clock;
+}
+
+// Cache data as block_num unless it's already cached (that copy is at least
+// as new) or was written after since. Returns 1 if it went in.
+int bcache_install(int block_num, const unsigned char *data, unsigned int since) {
+  if (!initialized) {
+    reset();
+  }
+  if (hash_lookup(block_num) != NULL || (int)(last_write[hash_index(block_num)] - since) > 0) {
+    return 0;
+  }
+  struct buf *b = bcache_get(block_num, 0);
+  if (b == NULL) {
+    return 0;
+  }
+  memcpy(b->data, data, BLOCK_SIZE);
+  return 1;
+}
+
+void bcache_sync(void) {  // Write back every dirty buffer; they stay cached
+  bcache_lock();
+  for (int i = 0; initialized && i < BCACHE_BLOCKS; i++) {
+    buf_flush(&bufs[i]);
+  }
+  bcache_unlock();
+}
@@ -0,0 +1,29 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "block.h"
+
+#define BCACHE_BLOCKS 64       // Fixed block budget for the cache
+#define BCACHE_HASH_SIZE 128   // Power of two so we can mask instead of mod
+
+struct buf {
+  int block_num;
+  int valid;
+  int dirty;
+  int pins;  // Outstanding bget() borrows; a pinned buffer is never evicted
+  struct buf *hash_next;
+  struct buf *lru_prev, *lru_next;
+  unsigned char data[BLOCK_SIZE];
+};
+
+void bcache_lock(void);
+void bcache_unlock(void);
+struct buf *bcache_get(int block_num, int fill);  // Call these two with bcache_lock() held
+struct buf *bcache_peek(int block_num);
+unsigned int bcache_clock(void);
+void bcache_note_write(int block_num);
+int bcache_install(int block_num, const unsigned char *data, unsigned int since);
+void bcache_sync(void);
+void bcache_reset(void);
+
+#endif
@@ -1,28 +1,203 @@
-#include <unistd.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
 #include "block.h"
+#include "bcache.h"
 #include "image.h"
 #include "free.h"
+#include "journal.h"
+#include "stats.h"
 
 unsigned char *bread(int block_num, unsigned char *block) {
-  int offset = block_num * BLOCK_SIZE;
-  lseek(image_fd, offset, SEEK_SET);
-  read(image_fd, block, BLOCK_SIZE);
-  return block;
+  STAT_TIME(HIST_BREAD);
+  STAT_COUNT(STAT_BREAD, 1);
+  STAT_COUNT(STAT_BYTES_READ, BLOCK_SIZE);
+  if (image_map != NULL) {  // The mapping already is the cache
+    return image_read(block_num, 1, block) == -1? NULL: block;
+  }
+  bcache_lock();
+  struct buf *b = bcache_get(block_num, 1);
+  if (b != NULL) {
+    memcpy(block, b->data, BLOCK_SIZE);
+  }
+  bcache_unlock();
+  return b == NULL? NULL: block;
 }
 
 void bwrite(int block_num, unsigned char *block) {
-  int offset = block_num * BLOCK_SIZE;
-  lseek(image_fd, offset, SEEK_SET);
-  write(image_fd, block, BLOCK_SIZE);
+  STAT_TIME(HIST_BWRITE);
+  STAT_COUNT(STAT_BWRITE, 1);
+  STAT_COUNT(STAT_BYTES_WRITTEN, BLOCK_SIZE);
+  if (image_map != NULL) {
+    image_write(block_num, 1, block);
+    return;
+  }
+  bcache_lock();
+  bcache_note_write(block_num);
+  int journaled = journal_record(block_num, block);  // Then it goes home at a checkpoint, not from here
+  struct buf *b = bcache_get(block_num, 0); // No need to read it in, we're replacing all of it
+  if (b != NULL) {
+    memcpy(b->data, block, BLOCK_SIZE);
+    b->dirty = !journaled;
+  }
+  else if (!journaled) {  // No buffer to hold it (they're all pinned), so it goes straight out
+    image_write(block_num, 1, block);
+  }
+  bcache_unlock();
+}
+
+// ----------Zero-copy reads-------------------------------------------------------------------------------------------
+
+  // bread() always copies into the caller's buffer. bget() instead hands back
+  // a pointer to the block itself: straight into the mapping for an mmap'd
+  // image, or into the buffer cache otherwise.
+
+  // The pointer is borrowed. It's read-only, it stays valid until you give it
+  // back with brelse(), and you must give it back. To change a block, bread()
+  // it into your own buffer and bwrite() that. Nothing stops another thread
+  // from bwrite()ing the block while you look at it; whatever lock covers
+  // the block's contents (the directory's inode lock, say) has to do that.
+
+const unsigned char *bget(int block_num) {
+  if (image_map != NULL) {
+    return image_block_addr(block_num);
+  }
+  bcache_lock();
+  struct buf *b = bcache_get(block_num, 1);
+  if (b != NULL) {
+    b->pins++;  // Keep the cache from recycling it while it's lent out
+  }
+  bcache_unlock();
+  return b == NULL? NULL: b->data;
+}
+
+void brelse(const unsigned char *block) {
+  if (block == NULL || image_map != NULL) {
+    return;
+  }
+  struct buf *b = (struct buf *)(block - offsetof(struct buf, data));
+  bcache_lock();
+  b->pins--;
+  bcache_unlock();
+}
+
+// ----------Multi-block I/O-------------------------------------------------------------------------------------------
+
+  // bread_range()/bwrite_range() move count contiguous blocks starting at
+  // block_num to or from buf (which must be count * BLOCK_SIZE bytes).
+
+  // They go around the cache so a bulk transfer doesn't flush out the hot
+  // metadata blocks, but they stay coherent with it: a read takes any block
+  // that's already cached (it may be dirty) from the cache and does one
+  // pread() per run of uncached blocks, and a write updates any cached copy.
+
+unsigned char *bread_range(int block_num, int count, unsigned char *buf) {
+  STAT_COUNT(STAT_BYTES_READ, (unsigned long long)count * BLOCK_SIZE);
+  int i = 0;
+  bcache_lock();
+  while (i < count) {
+    struct buf *b = bcache_peek(block_num + i);
+    if (b != NULL) {
+      memcpy(buf + i * BLOCK_SIZE, b->data, BLOCK_SIZE);
+      i++;
+      continue;
+    }
+    int run = 1;  // Gather up the run of uncached blocks and read it in one go
+    while (i + run < count && bcache_peek(block_num + i + run) == NULL) {
+      run++;
+    }
+    if (image_read(block_num + i, run, buf + i * BLOCK_SIZE) == -1) {
+      bcache_unlock();
+      return NULL;
+    }
+    i += run;
+  }
+  bcache_unlock();
+  return buf;
 }
 
+int bwrite_range(int block_num, int count, unsigned char *buf) {
+  if (journal_active()) {  // Straight to the image would skip the journal, so one at a time
+    for (int i = 0; i < count; i++) {
+      bwrite(block_num + i, buf + i * BLOCK_SIZE);
+    }
+    return 0;
+  }
+  STAT_COUNT(STAT_BYTES_WRITTEN, (unsigned long long)count * BLOCK_SIZE);
+  bcache_lock();  // Held across the write so a cached copy can't be flushed over it
+  if (image_write(block_num, count, buf) == -1) {
+    bcache_unlock();
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    bcache_note_write(block_num + i);
+    struct buf *b = bcache_peek(block_num + i);
+    if (b != NULL) {
+      memcpy(b->data, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+      b->dirty = 0;  // The disk has this data now
+    }
+  }
+  bcache_unlock();
+  return 0;
+}
+
+void bsync(void) {
+  bcache_sync();
+  image_flush();
+}
+
+  // The block map is read, searched and written back as one step, so
+  // alloc(), alloc_extent() and free_extent() each hold block_map_lock.
+
+static struct free_map block_map = { .block_num = FREE_DATA_BLOCK_NUM };
+static pthread_mutex_t block_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int alloc(void) {
+  STAT_TIME(HIST_ALLOC);
   unsigned char data_block[BLOCK_SIZE];
-  bread(FREE_DATA_BLOCK_NUM, data_block);
-  int low_free_bit = find_free(data_block);
+  pthread_mutex_lock(&block_map_lock);
+  bread(block_map.block_num, data_block);
+  int low_free_bit = free_map_find(&block_map, data_block);
   if(low_free_bit != -1) {
-    set_free(data_block, low_free_bit, 1);
-    bwrite(FREE_DATA_BLOCK_NUM ,data_block);
+    free_map_set(&block_map, data_block, low_free_bit, 1);
+    bwrite(block_map.block_num, data_block);
   }
+  pthread_mutex_unlock(&block_map_lock);
   return low_free_bit;
-}
\ No newline at end of file
+}
+
+// ----------Extents-------------------------------------------------------------------------------------------
+
+  // alloc_extent() grabs up to want contiguous blocks with one read and one
+  // write of the block map. It returns the first block and puts how many it
+  // actually got in *got; that's fewer than want when no run that long is
+  // free. Returns -1 (and *got is 0) when there are no free blocks at all.
+
+int alloc_extent(int want, int *got) {
+  *got = 0;
+  if (want <= 0) {
+    return -1;
+  }
+  unsigned char data_block[BLOCK_SIZE];
+  pthread_mutex_lock(&block_map_lock);
+  bread(block_map.block_num, data_block);
+  int start = free_map_find_run(&block_map, data_block, want, got);
+  if (start != -1) {
+    free_map_set_run(&block_map, data_block, start, *got, 1);
+    bwrite(block_map.block_num, data_block);
+  }
+  pthread_mutex_unlock(&block_map_lock);
+  return start;
+}
+
+void free_extent(int start, int count) {  // Give back count blocks starting at start
+  if (count <= 0) {
+    return;
+  }
+  unsigned char data_block[BLOCK_SIZE];
+  pthread_mutex_lock(&block_map_lock);
+  bread(block_map.block_num, data_block);
+  free_map_set_run(&block_map, data_block, start, count, 0);
+  bwrite(block_map.block_num, data_block);
+  pthread_mutex_unlock(&block_map_lock);
+}
@@ -6,6 +6,13 @@
 
 unsigned char *bread(int block_num, unsigned char *block);
 void bwrite(int block_num, unsigned char *block);
+const unsigned char *bget(int block_num);
+void brelse(const unsigned char *block);
+unsigned char *bread_range(int block_num, int count, unsigned char *buf);
+int bwrite_range(int block_num, int count, unsigned char *buf);
+void bsync(void);
 int alloc(void);
+int alloc_extent(int want, int *got);
+void free_extent(int start, int count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,149 @@
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "dcache.h"
+#include "image.h"
+
+// ----------Dentry Cache-------------------------------------------------------------------------------------------
+
+  // namei() would otherwise scan every directory on the path, block by block,
+  // on every call. This remembers what those scans found: (parent inode,
+  // name) -> child inode. It remembers misses too, as DCACHE_NEGATIVE, so
+  // looking up something that isn't there is also cheap the second time.
+
+  // Entries are found by hashing, and the least recently used one is reused
+  // when we need room. Anything that changes a directory must keep this up
+  // to date with dcache_enter()/dcache_remove(), while it holds the
+  // directory's inode lock so an older answer can't land on top of its own.
+
+struct dentry {
+  int valid;
+  int parent_num;
+  int inode_num;
+  char name[DCACHE_NAME_SIZE];
+  struct dentry *hash_next;
+  struct dentry *lru_prev, *lru_next;
+};
+
+static struct dentry dentries[DCACHE_ENTRIES];
+static struct dentry *hash[DCACHE_HASH_SIZE];
+static struct dentry lru;  // Sentinel: lru.lru_next is the most recently used
+static unsigned int dcache_generation;
+static pthread_mutex_t dcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_index(int parent_num, const char *name) {
+  unsigned int h = 2166136261u ^ parent_num;  // FNV-1a over the parent and the name
+  for (const char *p = name; *p != '\0'; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  return h & (DCACHE_HASH_SIZE - 1);
+}
+
+static void lru_unlink(struct dentry *d) {
+  d->lru_prev->lru_next = d->lru_next;
+  d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_push_front(struct dentry *d) {
+  d->lru_next = lru.lru_next;
+  d->lru_prev = &lru;
+  lru.lru_next->lru_prev = d;
+  lru.lru_next = d;
+}
+
+static void lru_push_back(struct dentry *d) {
+  d->lru_prev = lru.lru_prev;
+  d->lru_next = &lru;
+  lru.lru_prev->lru_next = d;
+  lru.lru_prev = d;
+}
+
+static void hash_remove(struct dentry *d) {
+  struct dentry **p = &hash[hash_index(d->parent_num, d->name)];
+  while (*p != NULL) {
+    if (*p == d) {
+      *p = d->hash_next;
+      break;
+    }
+    p = &(*p)->hash_next;
+  }
+  d->hash_next = NULL;
+  d->valid = 0;
+}
+
+static void dcache_check(void) {  // Entries from a different image are no good to us
+  if (dcache_generation == image_generation) {
+    return;
+  }
+  memset(hash, 0, sizeof hash);
+  lru.lru_next = lru.lru_prev = &lru;
+  for (int i = 0; i < DCACHE_ENTRIES; i++) {
+    dentries[i].valid = 0;
+    dentries[i].hash_next = NULL;
+    lru_push_back(&dentries[i]);
+  }
+  dcache_generation = image_generation;
+}
+
+static struct dentry *find(int parent_num, const char *name) {
+  for (struct dentry *d = hash[hash_index(parent_num, name)]; d != NULL; d = d->hash_next) {
+    if (d->parent_num == parent_num && strcmp(d->name, name) == 0) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+// Returns 1 and sets *inode_num (possibly to DCACHE_NEGATIVE) if we know
+// the answer, 0 if the directory has to be searched.
+int dcache_lookup(int parent_num, const char *name, int *inode_num) {
+  pthread_mutex_lock(&dcache_mutex);
+  dcache_check();
+  struct dentry *d = find(parent_num, name);
+  if (d != NULL) {
+    lru_unlink(d);
+    lru_push_front(d);
+    *inode_num = d->inode_num;
+  }
+  pthread_mutex_unlock(&dcache_mutex);
+  return d != NULL;
+}
+
+// Remember that name in parent_num is inode_num (or DCACHE_NEGATIVE if
+// there's no such entry), replacing whatever we thought before.
+void dcache_enter(int parent_num, const char *name, int inode_num) {
+  if (strlen(name) >= DCACHE_NAME_SIZE) {
+    return;  // Can't be in a directory anyway
+  }
+  pthread_mutex_lock(&dcache_mutex);
+  dcache_check();
+  struct dentry *d = find(parent_num, name);
+  if (d == NULL) {
+    d = lru.lru_prev;
+    if (d->valid) {
+      hash_remove(d);
+    }
+    d->parent_num = parent_num;
+    strcpy(d->name, name);
+    unsigned int i = hash_index(parent_num, name);
+    d->hash_next = hash[i];
+    hash[i] = d;
+    d->valid = 1;
+  }
+  d->inode_num = inode_num;
+  lru_unlink(d);
+  lru_push_front(d);
+  pthread_mutex_unlock(&dcache_mutex);
+}
+
+void dcache_remove(int parent_num, const char *name) {  // Forget name in parent_num, e.g. on unlink
+  pthread_mutex_lock(&dcache_mutex);
+  dcache_check();
+  struct dentry *d = find(parent_num, name);
+  if (d != NULL) {
+    hash_remove(d);
+    lru_unlink(d);
+    lru_push_back(d);  // Reuse this one first
+  }
+  pthread_mutex_unlock(&dcache_mutex);
+}
@@ -0,0 +1,13 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_ENTRIES 256    // How many (parent, name) lookups we remember
+#define DCACHE_HASH_SIZE 512  // Power of two so we can mask instead of mod
+#define DCACHE_NAME_SIZE 16   // Same as the name field of a directory entry
+#define DCACHE_NEGATIVE -1    // Cached "no such entry"
+
+int dcache_lookup(int parent_num, const char *name, int *inode_num);
+void dcache_enter(int parent_num, const char *name, int inode_num);
+void dcache_remove(int parent_num, const char *name);
+
+#endif
@@ -30,9 +30,10 @@ char *get_basename(const char *path, char *basename)
     p = path; // No slash in name, start at beginning
   else
     p++; // Start just after slash
-    strcpy(basename, p);
-    return basename;
+  strcpy(basename, p);
+  return basename;
 }
+#ifdef DIRBASENAME_MAIN
 int main(void)
 {
   char result[1024];
@@ -49,3 +50,4 @@ int main(void)
   puts(get_basename("foo", result)); // foo
   puts(get_basename("", result)); //
 }
+#endif
@@ -3,5 +3,4 @@
 
 char *get_dirname(const char *path, char *dirname);
 char *get_basename(const char *path, char *basename);
-int main(void);
 #endif
\ No newline at end of file
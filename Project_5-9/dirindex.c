@@ -0,0 +1,92 @@
+#include <string.h>
+#include "dirindex.h"
+#include "mkfs.h"
+#include "pack.h"
+
+// ----------Hashed Directory Index-------------------------------------------------------------------------------------------
+
+  // Directories are flat arrays of entries, so finding a name in a big one
+  // means reading every block. Once a directory has directory_index_threshold
+  // entries it gets an index block, hung off index_block in its inode.
+
+  // The index is DIRECTORY_INDEX_BUCKETS big-endian 16-bit masks. A name
+  // hashes to a bucket, and bit i of that bucket's mask is set if data block
+  // i of the directory has an entry whose name hashes there. Blocks past the
+  // first 16 share bits (block 16 uses bit 0 again, and so on), so a lookup
+  // only reads the blocks whose bit is set, usually just one or two.
+
+  // Bits are only ever set. A bit left over from a removed entry just costs
+  // an extra block read; it can never hide an entry. The entries themselves
+  // don't move, so directory_get() doesn't know or care about any of this.
+
+int directory_index_threshold = DIRECTORY_INDEX_THRESHOLD;
+
+unsigned int directory_index_hash(const char *name) {  // FNV-1a
+  unsigned int h = 2166136261u;
+  for (const char *p = name; *p != '\0'; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  return h % DIRECTORY_INDEX_BUCKETS;
+}
+
+static unsigned int block_bit(int block_index) {
+  return 1u << (block_index % INODE_PTR_COUNT);
+}
+
+// Which data blocks of dir might hold name. With no index, that's all of them.
+unsigned int directory_index_mask(struct inode *dir, const char *name) {
+  if (dir->index_block == 0) {
+    return 0xffff;
+  }
+  const unsigned char *index = bget(dir->index_block);
+  if (index == NULL) {
+    return 0xffff;
+  }
+  unsigned int mask = read_u16(index + directory_index_hash(name) * 2);
+  brelse(index);
+  return mask;
+}
+
+// Note that name now lives in data block block_index of dir.
+int directory_index_add(struct inode *dir, const char *name, int block_index) {
+  if (dir->index_block == 0) {
+    return 0;
+  }
+  unsigned char index[BLOCK_SIZE];
+  bread(dir->index_block, index);
+  unsigned char *slot = index + directory_index_hash(name) * 2;
+  write_u16(slot, read_u16(slot) | block_bit(block_index));
+  bwrite(dir->index_block, index);
+  return 0;
+}
+
+// Give dir an index covering everything that's in it now. The caller puts
+// the inode back, so index_block gets saved with it.
+int directory_index_build(struct inode *dir) {
+  unsigned short masks[DIRECTORY_INDEX_BUCKETS] = {0};  // Built in host order, packed once at the end
+  int num_entries = dir->size / DIRECTORY_ENTRY_SIZE;
+  for (int b = 0; b * ENTRIES_PER_BLOCK < num_entries; b++) {
+    int block_num = bmap(dir, b, 0);
+    const unsigned char *block = block_num > 0 ? bget(block_num) : NULL;
+    if (block == NULL) {
+      return -1;
+    }
+    for (int i = 0; i < ENTRIES_PER_BLOCK && b * ENTRIES_PER_BLOCK + i < num_entries; i++) {
+      char name[FILE_NAME_SIZE];
+      memcpy(name, block + i * DIRECTORY_ENTRY_SIZE + FILE_OFFSET, FILE_NAME_SIZE - 1);
+      name[FILE_NAME_SIZE - 1] = '\0';
+      masks[directory_index_hash(name)] |= block_bit(b);
+    }
+    brelse(block);
+  }
+
+  int index_block = alloc();
+  if (index_block == -1) {
+    return -1;
+  }
+  unsigned char index[BLOCK_SIZE];
+  write_u16_array(index, masks, DIRECTORY_INDEX_BUCKETS);
+  bwrite(index_block, index);
+  dir->index_block = index_block;
+  return 0;
+}
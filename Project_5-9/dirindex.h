@@ -0,0 +1,17 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "block.h"
+#include "inode.h"
+
+#define DIRECTORY_INDEX_BUCKETS (BLOCK_SIZE / 2)  // One 16-bit block mask per bucket
+#define DIRECTORY_INDEX_THRESHOLD 256             // Default entry count to start indexing at
+
+extern int directory_index_threshold;
+
+unsigned int directory_index_hash(const char *name);
+unsigned int directory_index_mask(struct inode *dir, const char *name);
+int directory_index_add(struct inode *dir, const char *name, int block_index);
+int directory_index_build(struct inode *dir);
+
+#endif
@@ -1,13 +1,25 @@
 #include <unistd.h>
+#include <stdint.h>
+#include <string.h>
 #include "free.h"
 #include "block.h"
+#include "image.h"
+#include "stats.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define BYTES_PER_WORD 8
+#define BYTES_PER_CHUNK 32
 
 int find_low_clear_bit(unsigned char x) {
-  for (int i = 0; i < BITS_PER_BYTE; i++)
-    if (!(x & (1 << i)))
-      return i;
-  
-  return -1;
+  if (x == 0xff) {
+    return -1;
+  }
+  return __builtin_ctz(~x & 0xff);
 }
 
 void set_free(unsigned char *block, int num, int set) {
@@ -21,12 +33,226 @@ void set_free(unsigned char *block, int num, int set) {
   }
 }
 
+// Load 8 map bytes as one word where bit k of the word is bit k of the
+// map, whatever the host byte order is. memcpy() keeps unaligned loads legal.
+static uint64_t load_word(const unsigned char *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof word);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+static void store_word(unsigned char *p, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(p, &word, sizeof word);
+}
+
+// Returns the byte offset of the first 32-byte chunk at or after byte that
+// isn't all ones, so the word scan below can start there.
+static int skip_full_chunks(const unsigned char *block, int byte) {
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi8(-1);
+  for (; byte + BYTES_PER_CHUNK <= BLOCK_SIZE; byte += BYTES_PER_CHUNK) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(block + byte));
+    if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != 0xffffffffu) {
+      break;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi8(-1);
+  for (; byte + BYTES_PER_CHUNK <= BLOCK_SIZE; byte += BYTES_PER_CHUNK) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)(block + byte));
+    __m128i hi = _mm_loadu_si128((const __m128i *)(block + byte + 16));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), ones)) != 0xffff) {
+      break;
+    }
+  }
+#else
+  (void)block;
+#endif
+  return byte;
+}
+
+// Instead of a byte and then a bit at a time, we skip fully allocated
+// 32-byte chunks with SIMD where we have it, then look at 64 bits at a
+// time: the low set bit of ~word is the low clear bit of the map.
 int find_free(unsigned char *block) {
-  for(int i = 0; i < BLOCK_SIZE; i++) {
-    int zero_bit = find_low_clear_bit(block[i]);
-    if (zero_bit != -1) {
-      return (i*BITS_PER_BYTE) + zero_bit;
+  for (int i = skip_full_chunks(block, 0); i < BLOCK_SIZE; i += BYTES_PER_WORD) {
+    uint64_t free_bits = ~load_word(block + i);
+    if (free_bits != 0) {
+      STAT_COUNT(STAT_FIND_FREE, 1);
+      STAT_RECORD(HIST_FIND_FREE_SCAN, i / BYTES_PER_WORD + 1);
+      return (i*BITS_PER_BYTE) + __builtin_ctzll(free_bits);
     }
   }
+  STAT_COUNT(STAT_FIND_FREE, 1);
+  STAT_RECORD(HIST_FIND_FREE_SCAN, MAP_WORDS);
   return -1;
-}
\ No newline at end of file
+}
+
+// ----------Free map summaries-------------------------------------------------------------------------------------------
+
+  // alloc() and ialloc() keep a struct free_map next to each map block. The
+  // summary is rebuilt from the block whenever a different image has been
+  // opened since it was built, and after that it's kept up to date by
+  // free_map_set(). So every change to the map needs to go through
+  // free_map_set() rather than set_free().
+
+static int word_is_full(unsigned char *block, int word) {
+  return load_word(block + word * BYTES_PER_WORD) == ~0ULL;
+}
+
+static void summary_update(struct free_map *fm, unsigned char *block, int word) {
+  unsigned long long bit = 1ULL << (word % BITS_PER_WORD);
+  if (word_is_full(block, word)) {
+    fm->full[word / BITS_PER_WORD] |= bit;
+  }
+  else {
+    fm->full[word / BITS_PER_WORD] &= ~bit;
+    if (word < fm->hint) {
+      fm->hint = word;
+    }
+  }
+}
+
+void free_map_load(struct free_map *fm, unsigned char *block) {
+  memset(fm->full, 0, sizeof fm->full);
+  fm->hint = MAP_WORDS;
+  for (int w = 0; w < MAP_WORDS; w++) {
+    summary_update(fm, block, w);
+  }
+  fm->generation = image_generation;
+}
+
+// Same answer as find_free(block), but it starts at the hint and checks
+// 64 map words per summary word, so it's close to O(1) however full the
+// map is.
+int free_map_find(struct free_map *fm, unsigned char *block) {
+  if (fm->generation != image_generation) {
+    free_map_load(fm, block);
+  }
+  int s = fm->hint / BITS_PER_WORD;
+  int looked = 0;  // Map words, the same unit find_free() counts; the summary is what lets us skip the rest
+  STAT_COUNT(STAT_FIND_FREE, 1);
+  while (s < SUMMARY_WORDS) {
+    unsigned long long not_full = ~fm->full[s];
+    if (not_full == 0) {
+      s++;
+      continue;
+    }
+    int word = s * BITS_PER_WORD + __builtin_ctzll(not_full);
+    unsigned long long free_bits = ~load_word(block + word * BYTES_PER_WORD);
+    looked++;
+    if (free_bits == 0) {  // Someone changed the map behind our back; note it and keep going
+      fm->full[s] |= 1ULL << (word % BITS_PER_WORD);
+      continue;
+    }
+    fm->hint = word;
+    STAT_RECORD(HIST_FIND_FREE_SCAN, looked);
+    return word * BITS_PER_WORD + __builtin_ctzll(free_bits);
+  }
+  fm->hint = MAP_WORDS;
+  STAT_RECORD(HIST_FIND_FREE_SCAN, looked);
+  return -1;
+}
+
+void free_map_set(struct free_map *fm, unsigned char *block, int num, int set) {
+  if (fm->generation != image_generation) {
+    free_map_load(fm, block);
+  }
+  set_free(block, num, set);
+  summary_update(fm, block, num / BITS_PER_WORD);
+}
+
+// ----------Runs of free bits-------------------------------------------------------------------------------------------
+
+  // These back the extent allocator. A run is found by hopping between the
+  // next clear bit and the next set bit a word at a time, so a long run
+  // costs one step per 64 bits instead of one per bit.
+
+static uint64_t mask_from(int bit) {  // Bits bit..63 of a word
+  return ~0ULL << (bit % BITS_PER_WORD);
+}
+
+static int next_clear(struct free_map *fm, unsigned char *block, int from) {
+  int word = from / BITS_PER_WORD;
+  uint64_t bits = ~load_word(block + word * BYTES_PER_WORD) & mask_from(from);
+  while (bits == 0) {
+    word++;
+    while (word < MAP_WORDS && (fm->full[word / BITS_PER_WORD] >> (word % BITS_PER_WORD)) & 1) {
+      word++;
+    }
+    if (word >= MAP_WORDS) {
+      return MAP_BITS;
+    }
+    bits = ~load_word(block + word * BYTES_PER_WORD);
+  }
+  return word * BITS_PER_WORD + __builtin_ctzll(bits);
+}
+
+static int next_set(unsigned char *block, int from) {
+  int word = from / BITS_PER_WORD;
+  uint64_t bits = load_word(block + word * BYTES_PER_WORD) & mask_from(from);
+  while (bits == 0) {
+    if (++word >= MAP_WORDS) {
+      return MAP_BITS;
+    }
+    bits = load_word(block + word * BYTES_PER_WORD);
+  }
+  return word * BITS_PER_WORD + __builtin_ctzll(bits);
+}
+
+// Find the lowest run of want clear bits. If there isn't one, settle for
+// the longest run there is. Returns its start and sets *got to its length
+// (at most want), or returns -1 if the map is full.
+int free_map_find_run(struct free_map *fm, unsigned char *block, int want, int *got) {
+  if (fm->generation != image_generation) {
+    free_map_load(fm, block);
+  }
+  int best = -1, best_len = 0;
+  int bit = fm->hint * BITS_PER_WORD;
+  while (bit < MAP_BITS) {
+    int start = next_clear(fm, block, bit);
+    if (start >= MAP_BITS) {
+      break;
+    }
+    int end = next_set(block, start);
+    if (end - start > best_len) {
+      best = start;
+      best_len = end - start;
+      if (best_len >= want) {
+        best_len = want;
+        break;
+      }
+    }
+    bit = end;
+  }
+  *got = best_len;
+  return best;
+}
+
+void free_map_set_run(struct free_map *fm, unsigned char *block, int start, int count, int set) {
+  if (start < 0 || count <= 0 || start + count > MAP_BITS) {
+    return;
+  }
+  if (fm->generation != image_generation) {
+    free_map_load(fm, block);
+  }
+  int bit = start, end = start + count;
+  while (bit < end) {
+    int word = bit / BITS_PER_WORD;
+    int n = BITS_PER_WORD - bit % BITS_PER_WORD;  // Bits we can do in this word
+    if (n > end - bit) {
+      n = end - bit;
+    }
+    uint64_t mask = (n == BITS_PER_WORD? ~0ULL: ((1ULL << n) - 1)) << (bit % BITS_PER_WORD);
+    uint64_t value = load_word(block + word * BYTES_PER_WORD);
+    store_word(block + word * BYTES_PER_WORD, set? value | mask: value & ~mask);
+    summary_update(fm, block, word);
+    bit += n;
+  }
+}
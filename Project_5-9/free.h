@@ -1,10 +1,33 @@
 #ifndef FREE_H
 #define FREE_H
 
+#include "block.h"
+
 #define BITS_PER_BYTE 8
+#define BITS_PER_WORD 64
+#define MAP_BITS (BLOCK_SIZE * BITS_PER_BYTE)
+#define MAP_WORDS (BLOCK_SIZE / (BITS_PER_WORD / BITS_PER_BYTE))   // 512 words in a map block
+#define SUMMARY_WORDS (MAP_WORDS / BITS_PER_WORD)                 // One summary bit per map word
+
+// In-memory companion to an on-disk free map. full[] has a bit set for
+// every 64-bit word of the map that is completely allocated, and hint is
+// the first map word that might have a clear bit. Together they let
+// free_map_find() go nearly straight to a free bit instead of scanning
+// from bit 0 every time.
+struct free_map {
+  int block_num;     // Where the map lives on disk
+  unsigned int generation;  // image_generation the summary was built for
+  int hint;
+  unsigned long long full[SUMMARY_WORDS];
+};
 
 int find_low_clear_bit(unsigned char x);
 void set_free(unsigned char *block, int num, int set);
 int find_free(unsigned char *block);
+void free_map_load(struct free_map *fm, unsigned char *block);
+int free_map_find(struct free_map *fm, unsigned char *block);
+void free_map_set(struct free_map *fm, unsigned char *block, int num, int set);
+int free_map_find_run(struct free_map *fm, unsigned char *block, int want, int *got);
+void free_map_set_run(struct free_map *fm, unsigned char *block, int start, int count, int set);
 
 #endif
\ No newline at end of file
@@ -1,18 +1,180 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "image.h"
+#include "block.h"
+#include "bcache.h"
+#include "inode.h"
+#include "journal.h"
+#include "stats.h"
 
 int image_fd;
+unsigned char *image_map = NULL;  // Non-NULL when the image was opened with image_open_mmap()
+unsigned int image_generation = 1;  // Bumped on every image_open() so in-memory summaries know to rebuild
+static size_t image_map_size;
+static int image_map_sync;
 
 int image_open(char *filename, int truncate) {
 	int flags = O_RDWR | O_CREAT;
 	if (truncate) {
 		flags |= O_TRUNC;
 	}
+	bcache_reset(); // Anything cached belongs to whatever image was open before
+	image_generation++;
 	image_fd = open(filename, flags, 0600);
 	return image_fd;
 }
 
+// Same as image_open(), but the whole image is mapped into memory. The file
+// is grown to at least num_blocks blocks first, since we can't touch pages
+// past the end of the file. If sync is set, every bsync() also msync()s the
+// mapping; otherwise the kernel writes pages back whenever it likes.
+int image_open_mmap(char *filename, int truncate, int num_blocks, int sync) {
+	if (image_open(filename, truncate) == -1) {
+		return -1;
+	}
+
+	struct stat st;
+	size_t want = (size_t)num_blocks * BLOCK_SIZE;
+	if (fstat(image_fd, &st) == -1) {
+		goto fail;
+	}
+	if ((size_t)st.st_size < want && ftruncate(image_fd, want) == -1) {
+		goto fail;
+	}
+	image_map_size = (size_t)st.st_size > want? (size_t)st.st_size: want;
+
+	void *map = mmap(NULL, image_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+	image_map = map;
+	image_map_sync = sync;
+	return image_fd;
+
+fail:
+	image_map_size = 0;
+	close(image_fd);
+	image_fd = -1;
+	return -1;
+}
+
 int image_close() {
+	isync(); // Dirty inodes go into their blocks first,
+	journal_close(); // the journal gets them home,
+	bsync(); // then push every dirty cached block out before the fd goes away
+	bcache_reset();
+	STAT_REPORT(); // SIMFS_STATS=1 prints the counters
+	if (image_map != NULL) {
+		munmap(image_map, image_map_size);
+		image_map = NULL;
+	}
+	image_map_size = 0;
 	return close(image_fd);
-}
\ No newline at end of file
+}
+
+// Throw away the contents of the image and make it num_blocks blocks of
+// zeros. Truncating to 0 and then growing leaves a sparse file, so this
+// is instant no matter how big the image is. Everything cached about the
+// old contents is dropped.
+int image_zero(int num_blocks) {
+	journal_discard();
+	bcache_reset();
+	image_generation++;
+	size_t size = (size_t)num_blocks * BLOCK_SIZE;
+	int mapped = image_map != NULL;
+	if (mapped) {
+		munmap(image_map, image_map_size);
+		image_map = NULL;
+		image_map_size = 0;
+	}
+	if (ftruncate(image_fd, 0) == -1 || ftruncate(image_fd, size) == -1) {
+		return -1;
+	}
+	if (mapped) { // Keep it mapped, at the new size
+		void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+		if (map == MAP_FAILED) {
+			return -1;
+		}
+		image_map = map;
+		image_map_size = size;
+	}
+	return 0;
+}
+
+// Pointer to block_num inside the mapping, or NULL if it's off the end.
+unsigned char *image_block_addr(int block_num) {
+	size_t offset = (size_t)block_num * BLOCK_SIZE;
+	if (image_map == NULL || block_num < 0 || offset + BLOCK_SIZE > image_map_size) {
+		return NULL;
+	}
+	return image_map + offset;
+}
+
+int image_flush(void) {  // Called at flush points; only does anything for a mapped image
+	if (image_map != NULL && image_map_sync) {
+		return msync(image_map, image_map_size, MS_SYNC);
+	}
+	return 0;
+}
+
+// Raw, uncached block I/O against the image. Everything above this goes
+// through the buffer cache; only the block layer should call these.
+//
+// These use pread()/pwrite(), so there's one syscall per call instead of an
+// lseek() plus a read()/write(), and nobody depends on the shared file
+// offset of image_fd. The offset is an off_t so big images don't overflow.
+int image_read(int block_num, int count, unsigned char *buf) {
+	STAT_COUNT(STAT_IMAGE_READS, 1);
+	off_t offset = (off_t)block_num * BLOCK_SIZE;
+	size_t len = (size_t)count * BLOCK_SIZE;
+	size_t done = 0;
+	if (image_map != NULL) {
+		if (block_num >= 0 && (size_t)offset < image_map_size) {
+			done = image_map_size - offset < len? image_map_size - offset: len;
+			memcpy(buf, image_map + offset, done);
+		}
+		memset(buf + done, 0, len - done);
+		return 0;
+	}
+	journal_read_begin(); // No checkpoint between the pread() and the patch
+	while (done < len) {
+		ssize_t n = pread(image_fd, buf + done, len - done, offset + done);
+		if (n < 0) {
+			journal_read_end();
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	memset(buf + done, 0, len - done); // Past the end of the image reads as zeros
+	journal_patch(block_num, count, buf); // and blocks not checkpointed yet read as the journal has them
+	journal_read_end();
+	return 0;
+}
+
+int image_write(int block_num, int count, unsigned char *buf) {
+	STAT_COUNT(STAT_IMAGE_WRITES, 1);
+	off_t offset = (off_t)block_num * BLOCK_SIZE;
+	size_t len = (size_t)count * BLOCK_SIZE;
+	size_t done = 0;
+	if (image_map != NULL) {
+		if (block_num < 0 || (size_t)offset + len > image_map_size) {
+			return -1;
+		}
+		memcpy(image_map + offset, buf, len);
+		return 0;
+	}
+	while (done < len) {
+		ssize_t n = pwrite(image_fd, buf + done, len - done, offset + done);
+		if (n <= 0) {
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
@@ -2,8 +2,16 @@
 #define IMAGE_H
 
 int image_open(char *filename, int truncate);
+int image_open_mmap(char *filename, int truncate, int num_blocks, int sync);
 int image_close(void);
+int image_zero(int num_blocks);
+unsigned char *image_block_addr(int block_num);
+int image_flush(void);
+int image_read(int block_num, int count, unsigned char *buf);
+int image_write(int block_num, int count, unsigned char *buf);
 
 extern int image_fd;
+extern unsigned char *image_map;
+extern unsigned int image_generation;
 
-#endif
\ No newline at end of file
+#endif
@@ -4,7 +4,14 @@
 #include "pack.h"
 #include "dirbasename.h"
 #include "mkfs.h"
+#include "image.h"
+#include "dcache.h"
+#include "dirindex.h"
+#include "journal.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 
 int get_block_num(int inode_num) {
   return inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;
@@ -17,8 +24,6 @@ int get_block_offset(int inode_num) {
 int get_block_offset_bytes(int block_offset) {
   return block_offset * INODE_SIZE;
 }
-static struct inode incore[MAX_SYS_OPEN_FILES] = {0};
-
 // ----------Finding an inode and Reading Data-------------------------------------------------------------------------------------------
 
   // Think of the inode blocks (there are 4 of them) on disk like a contiguous array of inodes.
@@ -47,61 +52,423 @@ static struct inode incore[MAX_SYS_OPEN_FILES] = {0};
 
 
 // ----------In-Core inodes-------------------------------------------------------------------------------------------
+
+  // The in-core inodes used to be a fixed array of 64 that got scanned from
+  // the front on every lookup. Now they live in chunks of INCORE_CHUNK_SIZE
+  // that we add as needed (so a pointer from iget() never moves), found
+  // through a hash table on inode_num that doubles when it gets crowded.
+
+  // Every in-core inode with a ref_count of 0 is also on a free list, oldest
+  // first. Those aren't forgotten right away: they stay in the hash with
+  // their data, so an iget() soon after an iput() doesn't have to go back to
+  // disk. The slot is only recycled when it reaches the front of the free list.
+
+  // incore_lock covers all of that: the chunks, the hash and the free list.
+  // It's only held for the lookup (and the read_inode() on a miss), never
+  // while anybody works on an inode. ref_count is atomic so an iput() that
+  // doesn't drop the last reference doesn't need the lock at all.
+
+  // What's in an inode is guarded by its own rwlock. Take ilock() before
+  // changing an inode (or anything it owns, like a directory's entries) and
+  // ilock_shared() to read it. With one exception, isync(), nobody takes
+  // incore_lock and then an inode lock, so holding an inode lock while you
+  // iget() or ialloc() something else is fine.
+
+static struct inode **chunks;
+static int chunk_count;
+static struct inode **hash;
+static unsigned int hash_size;
+static unsigned int hash_count;
+static struct inode free_list;  // Sentinel for the circular free list
+static unsigned int incore_generation;
+static int dirty_count;
+static pthread_mutex_t incore_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_index(unsigned int inode_num) {
+  return (inode_num * 2654435761u) & (hash_size - 1);
+}
+
+static void free_list_remove(struct inode *in) {
+  in->free_prev->free_next = in->free_next;
+  in->free_next->free_prev = in->free_prev;
+  in->free_next = in->free_prev = NULL;
+}
+
+static void free_list_append(struct inode *in) {
+  in->free_prev = free_list.free_prev;
+  in->free_next = &free_list;
+  free_list.free_prev->free_next = in;
+  free_list.free_prev = in;
+}
+
+static void hash_remove(struct inode *in) {
+  struct inode **p = &hash[hash_index(in->inode_num)];
+  while (*p != NULL) {
+    if (*p == in) {
+      *p = in->hash_next;
+      hash_count--;
+      break;
+    }
+    p = &(*p)->hash_next;
+  }
+  in->hash_next = NULL;
+  in->hashed = 0;
+}
+
+static int hash_resize(unsigned int new_size) {
+  struct inode **new_hash = calloc(new_size, sizeof *new_hash);
+  if (new_hash == NULL) {
+    return -1;
+  }
+  struct inode **old_hash = hash;
+  unsigned int old_size = hash_size;
+  hash = new_hash;
+  hash_size = new_size;
+  for (unsigned int i = 0; i < old_size; i++) {
+    struct inode *in = old_hash[i];
+    while (in != NULL) {
+      struct inode *next = in->hash_next;
+      unsigned int j = hash_index(in->inode_num);
+      in->hash_next = hash[j];
+      hash[j] = in;
+      in = next;
+    }
+  }
+  free(old_hash);
+  return 0;
+}
+
+static void hash_insert(struct inode *in) {
+  if (hash_count >= hash_size) {
+    hash_resize(hash_size * 2);  // If this fails we just live with longer chains
+  }
+  unsigned int i = hash_index(in->inode_num);
+  in->hash_next = hash[i];
+  hash[i] = in;
+  in->hashed = 1;
+  hash_count++;
+}
+
+static int incore_grow(void) {  // Add another chunk of free in-core inodes
+  struct inode *chunk = calloc(INCORE_CHUNK_SIZE, sizeof *chunk);
+  struct inode **new_chunks = realloc(chunks, (chunk_count + 1) * sizeof *chunks);
+  if (chunk == NULL || new_chunks == NULL) {
+    free(chunk);
+    if (new_chunks != NULL) {
+      chunks = new_chunks;
+    }
+    return -1;
+  }
+  chunks = new_chunks;
+  chunks[chunk_count++] = chunk;
+  for (int i = 0; i < INCORE_CHUNK_SIZE; i++) {
+    pthread_rwlock_init(&chunk[i].lock, NULL);
+    free_list_append(&chunk[i]);
+  }
+  return 0;
+}
+
+// Forget everything we have in core. This happens whenever a different
+// image gets opened, since cached inodes belong to the old one.
+static void incore_reset(void) {
+  if (hash == NULL) {
+    hash_size = INCORE_HASH_MIN_SIZE;
+    hash = calloc(hash_size, sizeof *hash);
+  }
+  else {
+    memset(hash, 0, hash_size * sizeof *hash);
+  }
+  hash_count = 0;
+  dirty_count = 0;
+  free_list.free_next = free_list.free_prev = &free_list;
+  for (int c = 0; c < chunk_count; c++) {
+    for (int i = 0; i < INCORE_CHUNK_SIZE; i++) {
+      struct inode *in = &chunks[c][i];
+      in->ref_count = 0;
+      in->dirty = 0;
+      in->hashed = 0;
+      in->hash_next = NULL;
+      free_list_append(in);
+    }
+  }
+  incore_generation = image_generation;
+}
+
+static void incore_check(void) {
+  if (hash == NULL || incore_generation != image_generation) {
+    incore_reset();
+  }
+}
+
+// For when you change an inode you're holding on to: it gets written out
+// with the next isync() even if you don't iput() it first.
+void imark_dirty(struct inode *in) {
+  if (!__atomic_exchange_n(&in->dirty, 1, __ATOMIC_ACQ_REL)) {
+    __atomic_add_fetch(&dirty_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void inode_write_back(struct inode *in) {
+  if (__atomic_exchange_n(&in->dirty, 0, __ATOMIC_ACQ_REL)) {  // Cleared first, so a change made while we write marks it again
+    __atomic_sub_fetch(&dirty_count, 1, __ATOMIC_RELAXED);
+    write_inode(in);
+  }
+}
+
+void ilock(struct inode *in) {
+  pthread_rwlock_wrlock(&in->lock);
+}
+
+// For an inode ialloc() just handed out. Nobody else has it yet, and
+// isync() only ever holds it briefly, so spin rather than wait: then
+// there's no lock order against whatever the caller holds (the parent
+// directory's lock, say).
+static void ilock_new(struct inode *in) {
+  while (pthread_rwlock_trywrlock(&in->lock) != 0) {
+    sched_yield();
+  }
+}
+
+void ilock_shared(struct inode *in) {
+  pthread_rwlock_rdlock(&in->lock);
+}
+
+void iunlock(struct inode *in) {
+  pthread_rwlock_unlock(&in->lock);
+}
+
 // Now we need to write two functions:
-struct inode *find_incore_free(void) {
-  for (int i = 0; i <MAX_SYS_OPEN_FILES; i++) {
-    if (incore[i].flags == 0) {   // If the ref_count field in the struct inode is 0, it's not being used.
-      return &incore[i]; // This finds the first free in-core inode in the incore array. It returns a pointer to that in-core inode
+
+// Hands back an in-core inode nobody is using (its ref_count is 0), taking it
+// off the free list and out of the hash, or NULL if we're out of memory.
+static struct inode *take_free(void) {
+  incore_check();
+  if (free_list.free_next == &free_list && incore_grow() == -1) {
+    return NULL;
+  }
+  struct inode *in = free_list.free_next;
+  free_list_remove(in);
+  if (in->hashed) {
+    inode_write_back(in);  // Last chance to save it
+    hash_remove(in);
+  }
+  return in;
+}
+
+// Finds the in-core inode for inode_num. That includes one whose ref_count
+// has dropped to 0 but is still cached; iget() knows to take it back off the
+// free list.
+static struct inode *lookup(unsigned int inode_num) {
+  incore_check();
+  for (struct inode *in = hash[hash_index(inode_num)]; in != NULL; in = in->hash_next) {
+    if (in->inode_num == inode_num) {
+      return in;
     }
   }
-  return NULL; // or NULL if there are no more free in-core inodes.
+  return NULL;
+}
+
+// The slot iget() would recycle next, left where it is: only iget()
+// takes slots off the free list, so there's nothing to give back.
+struct inode *find_incore_free(void) {
+  pthread_mutex_lock(&incore_lock);
+  incore_check();
+  struct inode *in = NULL;
+  if (free_list.free_next != &free_list || incore_grow() == 0) {
+    in = free_list.free_next;
+  }
+  pthread_mutex_unlock(&incore_lock);
+  return in;
 }
 
 struct inode *find_incore(unsigned int inode_num) {
-  for (int i = 0; i <MAX_SYS_OPEN_FILES; i++) {
-    if(incore[i].ref_count != 0 && incore[i].inode_num == inode_num) { // So find_incore() will search the array until it finds a struct inode with a non-zero ref_count AND the inode_num field matches the number passed to the function. Luckily, we have a field in the struct inode: inode_num. We just have to match this.
-      return &incore[i]; //It returns a pointer to that in-core inode 
+  pthread_mutex_lock(&incore_lock);
+  struct inode *in = lookup(inode_num);
+  pthread_mutex_unlock(&incore_lock);
+  return in;
+}
+
+// ----------Inode Block Cache-------------------------------------------------------------------------------------------
+
+  // read_inode() and write_inode() used to read the whole 4 KiB inode block
+  // to get at one 64-byte inode, and write_inode() wrote the whole block back
+  // every time.
+
+  // Instead we keep the last few inode blocks around already decoded, all
+  // INODES_PER_BLOCK of them at once. write_inode() just updates the decoded
+  // copy and marks the block dirty; the block gets encoded and written once
+  // when it's evicted or on inode_block_sync(), however many of its inodes
+  // changed in the meantime. inode_block_lock covers the whole cache.
+
+struct dinode {  // The on-disk fields of an inode
+  unsigned int size;
+  unsigned short owner_id;
+  unsigned char permissions;
+  unsigned char flags;
+  unsigned char link_count;
+  unsigned short block_ptr[INODE_PTR_COUNT];
+  unsigned short index_block;
+  unsigned short indirect;
+  unsigned short double_indirect;
+};
+
+struct inode_block {
+  int block_num;  // 0 when the slot is empty; block 0 is never an inode block
+  int dirty;
+  unsigned int last_used;
+  struct dinode inodes[INODES_PER_BLOCK];
+};
+
+static struct inode_block inode_blocks[INODE_BLOCK_CACHE_SIZE];
+static unsigned int inode_block_clock;
+static unsigned int inode_block_generation;
+static pthread_mutex_t inode_block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void decode_inode(const unsigned char *p, struct dinode *d) {
+  d->size = read_u32(p);
+  d->owner_id = read_u16(p + 4);
+  d->permissions = read_u8(p + 6);
+  d->flags = read_u8(p + 7);
+  d->link_count = read_u8(p + 8);
+  read_u16_array(d->block_ptr, p + 9, INODE_PTR_COUNT);
+  d->index_block = read_u16(p + INODE_INDEX_OFFSET);
+  d->indirect = read_u16(p + INODE_INDIRECT_OFFSET);
+  d->double_indirect = read_u16(p + INODE_DOUBLE_INDIRECT_OFFSET);
+}
+
+static void encode_inode(unsigned char *p, const struct dinode *d) {
+  write_u32(p, d->size);
+  write_u16(p + 4, d->owner_id);
+  write_u8(p + 6, d->permissions);
+  write_u8(p + 7, d->flags);
+  write_u8(p + 8, d->link_count);
+  write_u16_array(p + 9, d->block_ptr, INODE_PTR_COUNT);
+  write_u16(p + INODE_INDEX_OFFSET, d->index_block);
+  write_u16(p + INODE_INDIRECT_OFFSET, d->indirect);
+  write_u16(p + INODE_DOUBLE_INDIRECT_OFFSET, d->double_indirect);
+}
+
+static void dinode_from_inode(struct dinode *d, const struct inode *in) {
+  d->size = in->size;
+  d->owner_id = in->owner_id;
+  d->permissions = in->permissions;
+  d->flags = in->flags;
+  d->link_count = in->link_count;
+  memcpy(d->block_ptr, in->block_ptr, sizeof d->block_ptr);
+  d->index_block = in->index_block;
+  d->indirect = in->indirect;
+  d->double_indirect = in->double_indirect;
+}
+
+static void inode_from_dinode(struct inode *in, const struct dinode *d) {  // Leaves the in-core only fields alone
+  in->size = d->size;
+  in->owner_id = d->owner_id;
+  in->permissions = d->permissions;
+  in->flags = d->flags;
+  in->link_count = d->link_count;
+  memcpy(in->block_ptr, d->block_ptr, sizeof in->block_ptr);
+  in->index_block = d->index_block;
+  in->indirect = d->indirect;
+  in->double_indirect = d->double_indirect;
+}
+
+static int dinode_equal(const struct dinode *a, const struct dinode *b) {
+  return a->size == b->size && a->owner_id == b->owner_id && a->permissions == b->permissions &&
+    a->flags == b->flags && a->link_count == b->link_count && a->index_block == b->index_block &&
+    a->indirect == b->indirect && a->double_indirect == b->double_indirect &&
+    memcmp(a->block_ptr, b->block_ptr, sizeof a->block_ptr) == 0;
+}
+
+// Encode in into the INODE_SIZE bytes at p, laid out as on disk. mkfs()
+// uses this to build the root inode without going through any caches.
+void inode_pack(unsigned char *p, const struct inode *in) {
+  struct dinode d;
+  dinode_from_inode(&d, in);
+  encode_inode(p, &d);
+}
+
+static void inode_block_flush(struct inode_block *ib) {
+  if (ib->block_num == 0 || !ib->dirty) {
+    return;
+  }
+  unsigned char block[BLOCK_SIZE];
+  bread(ib->block_num, block);  // Keep whatever is in the bytes we don't decode
+  for (int i = 0; i < INODES_PER_BLOCK; i++) {
+    encode_inode(block + get_block_offset_bytes(i), &ib->inodes[i]);
+  }
+  bwrite(ib->block_num, block);
+  ib->dirty = 0;
+}
+
+void inode_block_sync(void) {
+  pthread_mutex_lock(&inode_block_lock);
+  for (int i = 0; inode_block_generation == image_generation && i < INODE_BLOCK_CACHE_SIZE; i++) {  // Nothing to do if what's cached is from another image
+    inode_block_flush(&inode_blocks[i]);
+  }
+  pthread_mutex_unlock(&inode_block_lock);
+}
+
+// Decoded copy of inode block block_num, loading it (and evicting the least
+// recently used one) if we have to. NULL if the block can't be read.
+static struct inode_block *get_inode_block(int block_num) {
+  if (inode_block_generation != image_generation) {  // A different image; what we have is stale
+    memset(inode_blocks, 0, sizeof inode_blocks);
+    inode_block_generation = image_generation;
+  }
+
+  struct inode_block *victim = &inode_blocks[0];
+  for (int i = 0; i < INODE_BLOCK_CACHE_SIZE; i++) {
+    struct inode_block *ib = &inode_blocks[i];
+    if (ib->block_num == block_num) {
+      ib->last_used = ++inode_block_clock;
+      return ib;
     }
+    if (ib->last_used < victim->last_used) {
+      victim = ib;
+    }
+  }
+
+  inode_block_flush(victim);
+  const unsigned char *block = bget(block_num);
+  if (block == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < INODES_PER_BLOCK; i++) {
+    decode_inode(block + get_block_offset_bytes(i), &victim->inodes[i]);
   }
-  return NULL; // or NULL if it can't be found.
+  brelse(block);
+  victim->block_num = block_num;
+  victim->dirty = 0;
+  victim->last_used = ++inode_block_clock;
+  return victim;
 }
 
 // ----------Reading and Writing inodes from Memory and Disk-------------------------------------------------------------------------------------------
   // We're going to write two functions:
 void read_inode(struct inode *in, int inode_num) {
-  int block_num = get_block_num(inode_num); // You'll have to map that inode number to a block
-  int block_offset_bytes = get_block_offset_bytes(inode_num); // and offset, as per above.
-  unsigned char *free_block = calloc(sizeof(unsigned char), BLOCK_SIZE);
-
-  bread(block_num, free_block); // Then you'll read the data from disk into a block
-
-  in->size = read_u32(free_block + block_offset_bytes);
-  in->owner_id = read_u16(free_block + block_offset_bytes + 4);
-  in->permissions = read_u8(free_block + block_offset_bytes + 6);
-  in->flags = read_u8(free_block + block_offset_bytes + 7);
-  in->link_count = read_u8(free_block + block_offset_bytes + 8);
-  for (int i = 0; i < INODE_PTR_COUNT; i++) {
-    in->block_ptr[i] = read_u16(free_block + block_offset_bytes + 9 + (i*2));
+  pthread_mutex_lock(&inode_block_lock);
+  struct inode_block *ib = get_inode_block(get_block_num(inode_num)); // You'll have to map that inode number to a block
+  if (ib != NULL) {
+    inode_from_dinode(in, &ib->inodes[get_block_offset(inode_num)]); // and offset, as per above.
   }
+  pthread_mutex_unlock(&inode_block_lock);
 }
 
 void write_inode(struct inode *in) {
-  int block_num = get_block_num(in->inode_num); // You'll have to map that inode number to a block
-  int block_offset_bytes = get_block_offset_bytes(in->inode_num); // and offset, as per above.
-  unsigned char *free_block = calloc(sizeof(unsigned char), BLOCK_SIZE);
-
-  bread(block_num, free_block); // Then you'll read the data from disk into a block
-
-  write_u32(free_block + block_offset_bytes, in->size);
-  write_u16(free_block + block_offset_bytes + 4, in->owner_id);
-  write_u8(free_block + block_offset_bytes + 6, in->permissions);
-  write_u8(free_block + block_offset_bytes + 7, in->flags);
-  write_u8(free_block + block_offset_bytes + 8, in->link_count);
-  for (int i = 0; i < INODE_PTR_COUNT; i++) {
-    write_u16(free_block + block_offset_bytes + 9 + (i*2), in->block_ptr[i]);
+  struct dinode updated;
+  dinode_from_inode(&updated, in);
+
+  pthread_mutex_lock(&inode_block_lock);
+  struct inode_block *ib = get_inode_block(get_block_num(in->inode_num)); // You'll have to map that inode number to a block
+  if (ib != NULL) {
+    struct dinode *d = &ib->inodes[get_block_offset(in->inode_num)]; // and offset, as per above.
+    if (!dinode_equal(d, &updated)) { // Nothing changed, so don't make the block dirty
+      *d = updated;
+      ib->dirty = 1; // It goes out to disk with the rest of its block later
+    }
   }
-  bwrite(block_num, free_block); // And lastly you'll write the updated block back out to disk.
-}  
+  pthread_mutex_unlock(&inode_block_lock);
+}
 
 // ----------Higher-Level Functions: iget()-------------------------------------------------------------------------------------------
 
@@ -111,20 +478,31 @@ void write_inode(struct inode *in) {
 
   // iget() will glue this stuff together.
 struct inode *iget(int inode_num) { // Return a pointer to an in-core inode for the given inode number, or NULL on failure.
-  struct inode *incore_node = find_incore(inode_num); // Search for the inode number in-core (find_incore())
+  STAT_TIME(HIST_IGET);
+  pthread_mutex_lock(&incore_lock);
+  struct inode *incore_node = lookup(inode_num); // Search for the inode number in-core (find_incore())
   if (incore_node != NULL) { // If found:
-    incore_node->ref_count++;  // Increment the ref_count
+    if (__atomic_load_n(&incore_node->ref_count, __ATOMIC_ACQUIRE) == 0) {  // Cached but idle; it's in use again
+      free_list_remove(incore_node);
+    }
+    __atomic_add_fetch(&incore_node->ref_count, 1, __ATOMIC_ACQ_REL);  // Increment the ref_count
+    pthread_mutex_unlock(&incore_lock);
+    STAT_COUNT(STAT_IGET_HIT, 1);
     return incore_node;  // Return the pointer
   }
 
-  struct inode *incore_free_node = find_incore_free();  // Find a free in-core inode (find_incore_free())
+  struct inode *incore_free_node = take_free();  // Find a free in-core inode and take it off the free list
   if (incore_free_node == NULL) {// If none found:
+    pthread_mutex_unlock(&incore_lock);
     return NULL; // Return NULL
   }
   
   read_inode(incore_free_node, inode_num);  // Read the data from disk into it (read_inode())
+  STAT_COUNT(STAT_IGET_READ, 1);
   incore_free_node->ref_count = 1;  // Set the inode's ref_count to 1
   incore_free_node->inode_num = inode_num;  // Set the inode's inode_num to the inode number that was passed in
+  hash_insert(incore_free_node);  // Only now can another iget() find it, so nobody sees it half read
+  pthread_mutex_unlock(&incore_lock);
   return incore_free_node;  // Return the pointer to the inode
 }
 
@@ -132,36 +510,101 @@ struct inode *iget(int inode_num) { // Return a pointer to an in-core inode for
 
   // This is the opposite of iget(). It effectively frees the inode if no one is using it.
 
+  // It used to write the inode out right away. Now it only marks it dirty;
+  // the write happens when the slot gets recycled, on isync(), or once
+  // ISYNC_THRESHOLD inodes are waiting. A run of iget()/iput() on the same
+  // inode then costs one write, not one per iput().
+
 void iput(struct inode *in) { // decrement the reference count on the inode. If it falls to 0, write the inode to disk.
-  if (in->ref_count == 0) {  // If ref_count on in is already 0:
+  unsigned int ref = __atomic_load_n(&in->ref_count, __ATOMIC_ACQUIRE);
+  while (ref > 1) {  // Not the last reference, so the free list doesn't care
+    if (__atomic_compare_exchange_n(&in->ref_count, &ref, ref - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&incore_lock);  // Might be the last one; iget() can't revive it while we decide
+  if (__atomic_load_n(&in->ref_count, __ATOMIC_ACQUIRE) == 0) {  // If ref_count on in is already 0:
+    pthread_mutex_unlock(&incore_lock);
     return; // Return
   }
-  in->ref_count--;  // Decrement ref_count
-  if (in->ref_count == 0) { // If ref_count is 0:
-    write_inode(in);  // Save the inode to disk (write_inode())
+  int sync = 0;
+  if (__atomic_sub_fetch(&in->ref_count, 1, __ATOMIC_ACQ_REL) == 0) { // Decrement ref_count. If ref_count is 0:
+    imark_dirty(in);  // We can't tell what the caller changed, so it'll get saved (write_inode()) later
+    free_list_append(in);  // Still cached, but its slot can be recycled now
+    sync = __atomic_load_n(&dirty_count, __ATOMIC_RELAXED) >= ISYNC_THRESHOLD;
+  }
+  pthread_mutex_unlock(&incore_lock);
+  if (sync) {
+    isync();
   }
 }
+
+// Write every dirty in-core inode into its inode block, then write the dirty
+// inode blocks. That leaves them in the buffer cache; image_close() calls
+// this and then bsync() so it all goes out in one pass.
+
+// An inode somebody has ilock()ed is skipped rather than waited for (that
+// could deadlock against an iget() under their lock). It stays dirty and
+// goes out next time.
+void isync(void) {
+  pthread_mutex_lock(&incore_lock);
+  if (hash == NULL || incore_generation != image_generation) {
+    pthread_mutex_unlock(&incore_lock);
+    return;
+  }
+  for (int c = 0; c < chunk_count; c++) {
+    for (int i = 0; i < INCORE_CHUNK_SIZE; i++) {
+      struct inode *in = &chunks[c][i];
+      if (in->hashed && __atomic_load_n(&in->dirty, __ATOMIC_RELAXED) && pthread_rwlock_tryrdlock(&in->lock) == 0) {
+        inode_write_back(in);
+        iunlock(in);
+      }
+    }
+  }
+  pthread_mutex_unlock(&incore_lock);
+  inode_block_sync();
+}
 // ----------Higher-Level Functions: iput()-------------------------------------------------------------------------------------------
 // So ialloc() will just be the same as iget(), with the added functionality that ialloc() will allocate a new inode(), whereas iget() only returns existing inodes.
 
 // Both of the functions will return a pointer to an in-core inode.
 
+static struct free_map inode_map = { .block_num = FREE_INODE_BLOCK_NUM };
+static pthread_mutex_t inode_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_inode_num(int inode_num) {  // Clear its bit in the inode map
+  unsigned char map_block[BLOCK_SIZE];
+  pthread_mutex_lock(&inode_map_lock);
+  bread(inode_map.block_num, map_block);
+  free_map_set(&inode_map, map_block, inode_num, 0);
+  bwrite(inode_map.block_num, map_block);
+  pthread_mutex_unlock(&inode_map_lock);
+}
+
 struct inode *ialloc(void) {
-  unsigned char inode_map[BLOCK_SIZE];
-  unsigned char *free_block = calloc(sizeof(unsigned char), BLOCK_SIZE);
-  bread(FREE_INODE_BLOCK_NUM, inode_map);
-  int free_bit = find_free(free_block); // Save the inode number of the newly-allocated inode (returned by find_free());
-  if(free_bit == -1) { // If none are free: Return NULL
+  STAT_TIME(HIST_IALLOC);
+  unsigned char map_block[BLOCK_SIZE];
+  pthread_mutex_lock(&inode_map_lock);
+  bread(inode_map.block_num, map_block);
+  int free_bit = free_map_find(&inode_map, map_block); // Save the inode number of the newly-allocated inode (returned by find_free());
+  if(free_bit == -1 || free_bit >= MAX_INODES) { // If none are free: Return NULL
+    pthread_mutex_unlock(&inode_map_lock);
     return NULL;
   }
+  free_map_set(&inode_map, map_block, free_bit, 1); // Mark it allocated in the inode map
+  bwrite(inode_map.block_num, map_block);
+  pthread_mutex_unlock(&inode_map_lock);
 
   struct inode* incore = iget(free_bit);  // Get an in-core version of the inode (iget())
   if (incore == NULL) {// If not found:
+    free_inode_num(free_bit);  // Nobody's going to use it
     return NULL;  // Return NULL
   }
 
   // Initialize the inode:
   // Set the size, owner ID, permissions, and flags to 0.
+  ilock_new(incore);  // isync() on another thread may be writing it back
   incore->size = 0;
   incore->owner_id = 0;
   incore->permissions = 0;
@@ -170,61 +613,362 @@ struct inode *ialloc(void) {
   for (int i = 0; i < INODE_PTR_COUNT; i++) { // Set all the block pointers to 0.
     incore->block_ptr[i] = 0; 
   }
+  incore->index_block = 0;
+  incore->indirect = 0;
+  incore->double_indirect = 0;
+  iunlock(incore);  // iget() already set inode_num, under incore_lock where lookup() reads it
 
-  incore->inode_num = free_bit; // Set the inode_num field to the inode number (from find_free())
-
-  write_inode(incore);  // Save the inode to disk (write_inode())
+  imark_dirty(incore);  // The caller is about to change it anyway; save it to disk (write_inode()) later
 
   return incore; // Return the pointer to the in-core inode.
 }
 
-struct inode *namei(char *path) { // Find the inode for the parent directory that will hold the new entry (namei()).
-  if (*path == '/') {// If the path is /, it returns the root directory's in-core inode.
-    return iget(ROOT_INODE_NUM);
+static void ifree(struct inode *in) {  // Undo ialloc() for an inode that never got used; its blocks are the caller's to free
+  int inode_num = in->inode_num;
+  ilock_new(in);
+  in->size = 0;
+  in->flags = 0;
+  for (int i = 0; i < INODE_PTR_COUNT; i++) {
+    in->block_ptr[i] = 0;
   }
-  else {
+  iunlock(in);
+  imark_dirty(in);
+  iput(in);
+  free_inode_num(inode_num);
+}
+
+// ----------Block Mapping: bmap()-------------------------------------------------------------------------------------------
+
+  // The 16 direct block pointers only reach 64 KiB into a file. After them
+  // comes one indirect block holding PTRS_PER_BLOCK more pointers, then one
+  // double indirect block pointing at up to PTRS_PER_BLOCK indirect blocks.
+  // bmap() turns a block index within the file into a block number on disk.
+
+  // Walking the tree reads the same few indirect blocks over and over, so
+  // the last INDIRECT_CACHE_SIZE of them are kept decoded. Changes are written
+  // straight through to the block, so there's nothing to flush later.
+  // indirect_lock covers the cache and every indirect block's contents. The
+  // caller of bmap() holds the inode's lock, shared or (to create) exclusive.
+
+struct indirect_block {
+  int block_num;  // 0 when the slot is empty
+  unsigned int last_used;
+  unsigned short ptr[PTRS_PER_BLOCK];
+};
+
+static struct indirect_block indirect_blocks[INDIRECT_CACHE_SIZE];
+static unsigned int indirect_clock;
+static unsigned int indirect_generation;
+static pthread_mutex_t indirect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct indirect_block *get_indirect(int block_num) {
+  if (indirect_generation != image_generation) {
+    memset(indirect_blocks, 0, sizeof indirect_blocks);
+    indirect_generation = image_generation;
+  }
+
+  struct indirect_block *victim = &indirect_blocks[0];
+  for (int i = 0; i < INDIRECT_CACHE_SIZE; i++) {
+    struct indirect_block *ib = &indirect_blocks[i];
+    if (ib->block_num == block_num) {
+      ib->last_used = ++indirect_clock;
+      return ib;
+    }
+    if (ib->last_used < victim->last_used) {
+      victim = ib;
+    }
+  }
+
+  const unsigned char *block = bget(block_num);
+  if (block == NULL) {
     return NULL;
   }
+  read_u16_array(victim->ptr, block, PTRS_PER_BLOCK);
+  brelse(block);
+  victim->block_num = block_num;
+  victim->last_used = ++indirect_clock;
+  return victim;
+}
+
+static int alloc_zeroed(void) {  // A new block of pointers has to start out all holes
+  int block_num = alloc();
+  if (block_num != -1) {
+    unsigned char zero[BLOCK_SIZE] = {0};
+    bwrite(block_num, zero);
+  }
+  return block_num;
+}
+
+  // Follow one of the inode's own pointers, filling it in first if create is
+  // set. Returns the block number, 0 for a hole, or -1 if allocation failed.
+static int inode_pointer(struct inode *in, unsigned short *ptr, int create, int zeroed) {
+  if (*ptr == 0 && create) {
+    int block_num = zeroed ? alloc_zeroed() : alloc();
+    if (block_num == -1) {
+      return -1;
+    }
+    *ptr = block_num;
+    imark_dirty(in);
+  }
+  return *ptr;
+}
+
+  // Same thing for entry slot of indirect block block_num.
+static int indirect_pointer(int block_num, int slot, int create, int zeroed) {
+  struct indirect_block *ib = get_indirect(block_num);
+  if (ib == NULL) {
+    return -1;
+  }
+  if (ib->ptr[slot] == 0 && create) {
+    int new_block = zeroed ? alloc_zeroed() : alloc();  // Doesn't touch the indirect cache, so ib stays put
+    if (new_block == -1) {
+      return -1;
+    }
+    unsigned char block[BLOCK_SIZE];
+    bread(block_num, block);
+    write_u16(block + slot * 2, new_block);
+    bwrite(block_num, block);
+    ib->ptr[slot] = new_block;
+  }
+  return ib->ptr[slot];
+}
+
+static int map_block(struct inode *in, int file_block, int create) {
+  if (file_block < INODE_PTR_COUNT) {
+    return inode_pointer(in, &in->block_ptr[file_block], create, 0);
+  }
+
+  file_block -= INODE_PTR_COUNT;
+  if (file_block < PTRS_PER_BLOCK) {
+    int single = inode_pointer(in, &in->indirect, create, 1);
+    if (single <= 0) {
+      return single;
+    }
+    return indirect_pointer(single, file_block, create, 0);
+  }
+
+  file_block -= PTRS_PER_BLOCK;
+  int dbl = inode_pointer(in, &in->double_indirect, create, 1);
+  if (dbl <= 0) {
+    return dbl;
+  }
+  int single = indirect_pointer(dbl, file_block / PTRS_PER_BLOCK, create, 1);
+  if (single <= 0) {
+    return single;
+  }
+  return indirect_pointer(single, file_block % PTRS_PER_BLOCK, create, 0);
+}
+
+  // Disk block holding block file_block of the file, allocating it (and any
+  // indirect blocks on the way) if create is set. Returns 0 for a hole when
+  // create isn't set, and -1 if file_block is out of range or we ran out of
+  // blocks. New data blocks aren't zeroed; the caller is about to write them.
+int bmap(struct inode *in, int file_block, int create) {
+  if (file_block < 0 || file_block >= MAX_FILE_BLOCKS) {
+    return -1;
+  }
+  if (file_block < INODE_PTR_COUNT && (in->block_ptr[file_block] != 0 || !create)) {
+    return in->block_ptr[file_block];  // Most lookups; no need for the lock
+  }
+  pthread_mutex_lock(&indirect_lock);
+  int block_num = map_block(in, file_block, create);
+  pthread_mutex_unlock(&indirect_lock);
+  return block_num;
+}
+
+// ----------Path Lookup: namei()-------------------------------------------------------------------------------------------
+
+  // Look name up in directory dir, which the caller has locked (shared is
+  // enough). Only name goes into the dentry cache, found or not: entering
+  // every sibling we pass would flush the cache on each scan of a big
+  // directory. Returns the inode number or DCACHE_NEGATIVE.
+static int directory_find(struct inode *dir, const char *name) {
+  int found = DCACHE_NEGATIVE;
+  if (dcache_lookup(dir->inode_num, name, &found)) {
+    return found;
+  }
+
+  // Only the blocks the directory's index says could have it. Without an
+  // index that's every block.
+  unsigned int mask = directory_index_mask(dir, name);
+  int num_entries = dir->size / DIRECTORY_ENTRY_SIZE;
+  for (int b = 0; b * ENTRIES_PER_BLOCK < num_entries && found == DCACHE_NEGATIVE; b++) {
+    if (!(mask & (1u << (b % INODE_PTR_COUNT)))) {
+      continue;
+    }
+    int block_num = bmap(dir, b, 0);
+    const unsigned char *block = block_num > 0 ? bget(block_num) : NULL;
+    if (block == NULL) {
+      break;
+    }
+    for (int i = 0; i < ENTRIES_PER_BLOCK && b * ENTRIES_PER_BLOCK + i < num_entries; i++) {
+      const unsigned char *raw = block + i * DIRECTORY_ENTRY_SIZE;
+      char ent_name[FILE_NAME_SIZE];
+      memcpy(ent_name, raw + FILE_OFFSET, FILE_NAME_SIZE - 1);
+      ent_name[FILE_NAME_SIZE - 1] = '\0';
+      if (strcmp(ent_name, name) == 0) {
+        found = read_u16(raw);
+        break;
+      }
+    }
+    brelse(block);
+  }
+
+  dcache_enter(dir->inode_num, name, found);  // Negative if it isn't there
+  return found;
+}
+
+  // Same, for a directory nobody has locked yet. A dentry cache hit doesn't
+  // need the directory at all.
+static int directory_lookup(int dir_num, const char *name) {
+  int found = DCACHE_NEGATIVE;
+  if (dcache_lookup(dir_num, name, &found)) {
+    return found;
+  }
+
+  struct inode *dir = iget(dir_num);
+  if (dir == NULL) {
+    return DCACHE_NEGATIVE;
+  }
+  if (dir->flags == DIRECTORY_FLAG) { // Only a directory has entries
+    ilock_shared(dir);
+    found = directory_find(dir, name);
+    iunlock(dir);
+  }
+  iput(dir);
+  return found;
+}
+
+struct inode *namei(char *path) { // Find the inode for the parent directory that will hold the new entry (namei()).
+  STAT_TIME(HIST_NAMEI);
+  if (*path != '/') { // There's no current directory, so paths have to be absolute
+    return NULL;
+  }
+  // If the path is /, it returns the root directory's in-core inode.
   // If the path is /foo, it returns foo's in-core inode.
   // If the path is /foo/bar, it returns bar's in-core inode.
   // If the path is invalid (i.e. a component isn't found), it returns NULL.
-  
+  int inode_num = ROOT_INODE_NUM;
+  const char *p = path;
+  while (*p != '\0') {
+    while (*p == '/') {
+      p++;
+    }
+    int len = strcspn(p, "/");
+    if (len == 0) {
+      break; // Trailing slash
+    }
+    if (len >= FILE_NAME_SIZE) {
+      return NULL; // Too long to be in any directory
+    }
+    char name[FILE_NAME_SIZE];
+    memcpy(name, p, len);
+    name[len] = '\0';
+    inode_num = directory_lookup(inode_num, name);
+    if (inode_num == DCACHE_NEGATIVE) {
+      return NULL;
+    }
+    p += len;
+  }
+  return iget(inode_num);
 }
 
-int directory_make(char *path) {
-  char *dirname = calloc(MAX_PATH_LENGTH, sizeof(char));
-  char *basename = calloc(MAX_PATH_LENGTH, sizeof(char));
+static int make_directory(char *path) {
+  char dirname[MAX_PATH_LENGTH];
+  char basename[MAX_PATH_LENGTH];
+  if (strlen(path) >= MAX_PATH_LENGTH) {
+    return -1;
+  }
   get_dirname(path, dirname); // Find the directory path that will contain the new directory.
   get_basename(path, basename); // Find the new directory name from the path.
+  if (basename[0] == '\0' || strchr(basename, '/') != NULL || strlen(basename) >= FILE_NAME_SIZE) {
+    return -1;
+  }
   struct inode *parenti = namei(dirname);  // Find the inode for the parent directory that will hold the new entry (namei()).
   if (!parenti) {
     return -1;
   }
+  if (parenti->flags != DIRECTORY_FLAG) {
+    iput(parenti);
+    return -1;
+  }
+  ilock(parenti);  // Held until the new entry is in, so two of us can't add the same name or the same slot
+  int numitems = parenti->size/DIRECTORY_ENTRY_SIZE;  // From the parent directory inode, find the block that will contain the new directory entry (using the size and block_ptr fields).
+  int parent_block_index = numitems / ENTRIES_PER_BLOCK;
+  if (parent_block_index >= MAX_FILE_BLOCKS ||
+      directory_find(parenti, basename) != DCACHE_NEGATIVE) { // Full, or already there
+    iunlock(parenti);
+    iput(parenti);
+    return -1;
+  }
+
   struct inode *newi = ialloc();  // Create a new inode for the new directory (ialloc()).
-  struct inode *new_data_block = alloc();  // Create a new data block for the new directory entries (alloc()).
-  char new_block[BLOCK_SIZE];  // Create a new block-sized array for the new directory data block and 
+  int new_data_block = alloc();  // Create a new data block for the new directory entries (alloc()).
+  if (newi == NULL || new_data_block == -1) {
+    if (newi != NULL) {
+      ifree(newi);
+    }
+    if (new_data_block != -1) {
+      free_extent(new_data_block, 1);
+    }
+    iunlock(parenti);
+    iput(parenti);
+    return -1;
+  }
+  unsigned char new_block[BLOCK_SIZE] = {0};  // Create a new block-sized array for the new directory data block and 
   write_u16(new_block, newi->inode_num);  // initialize it . and .. files.
   strcpy((char*)new_block + FILE_OFFSET, ".");
   write_u16(new_block + DIRECTORY_ENTRY_SIZE, parenti->inode_num);
   strcpy((char*)new_block + FILE_OFFSET + DIRECTORY_ENTRY_SIZE, "..");
 
+  ilock_new(newi);  // Not for other users (it has none yet) but for isync()
   newi->flags = DIRECTORY_FLAG; // Initialize the new directory in-core inode with a proper size and other fields, similar to how we did with the hard-coded root directory in the previous project.
   newi->size = DIRECTORY_SIZE;
   newi->block_ptr[0] = new_data_block;
+  iunlock(newi);
 
   bwrite(new_data_block, new_block);  // Write the new directory data block to disk (bwrite()).
-  int numitems = parenti->size/DIRECTORY_ENTRY_SIZE;  // From the parent directory inode, find the block that will contain the new directory entry (using the size and block_ptr fields).
-  int parent_block_num = numitems/MAX_PATH_LENGTH;
-  unsigned char parentblock[BLOCK_SIZE];
-  bread(parenti->block_ptr[parent_block_num], parentblock); // Read that block into memory unless you're creating a new one (bread()), and add the new directory entry to it.  
 
-  bwrite(parent_block_num, parentblock);  // Write that block to disk (bwrite()).
+  unsigned char parentblock[BLOCK_SIZE] = {0};
+  int new_block_needed = numitems % ENTRIES_PER_BLOCK == 0; // The last block is full, so the entry starts a new one
+  int parent_block = bmap(parenti, parent_block_index, new_block_needed);
+  if (parent_block <= 0) {
+    ifree(newi);
+    free_extent(new_data_block, 1);
+    iunlock(parenti);
+    iput(parenti);
+    return -1;
+  }
+  if (!new_block_needed) {
+    bread(parent_block, parentblock); // Read that block into memory unless you're creating a new one (bread()), and add the new directory entry to it.  
+  }
+  unsigned char *ent = parentblock + (numitems % ENTRIES_PER_BLOCK) * DIRECTORY_ENTRY_SIZE;
+  write_u16(ent, newi->inode_num);
+  strcpy((char*)ent + FILE_OFFSET, basename);
+
+  bwrite(parent_block, parentblock);  // Write that block to disk (bwrite()).
+
+  parenti->size += DIRECTORY_ENTRY_SIZE;  // Update the parent directory's size field (which should increase by 32, the size of the new directory entry.
+  if (parenti->index_block != 0) { // Keep the parent's name index up to date, or start one once it's big enough
+    directory_index_add(parenti, basename, parent_block_index);
+  }
+  else if ((int)(parenti->size / DIRECTORY_ENTRY_SIZE) >= directory_index_threshold) {
+    directory_index_build(parenti);
+  }
+  dcache_enter(parenti->inode_num, basename, newi->inode_num); // Replaces the negative entry from the check above
+  iunlock(parenti);
 
-  parenti->size += 32;  // Update the parent directory's size field (which should increase by 32, the size of the new directory entry.
-  
   iput(newi); // Release the new directory's in-core inode (iput()).
 
   iput(parenti); // Release the parent directory's in-core inode (iput()).
 
   return 0;
-}
\ No newline at end of file
+}
+
+int directory_make(char *path) {  // All of its writes go in one journal transaction
+  STAT_TIME(HIST_DIRECTORY_MAKE);
+  journal_start();
+  int result = make_directory(path);
+  journal_stop();
+  return result;
+}
@@ -1,15 +1,27 @@
 #ifndef INODE_H
 
 #define INODE_H
+#include <pthread.h>
 #define BLOCK_SIZE 4096
 #define INODE_SIZE 64
 #define INODE_FIRST_BLOCK 3
+#define INODE_BLOCK_COUNT 4
 #define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define MAX_INODES (INODE_BLOCK_COUNT * INODES_PER_BLOCK)  // The inode map has room for more, but the inode blocks don't
 #define FREE_INODE_BLOCK_NUM 1
-#define MAX_SYS_OPEN_FILES 64
+#define INCORE_CHUNK_SIZE 64     // In-core inodes are added this many at a time
+#define INCORE_HASH_MIN_SIZE 64  // Starting bucket count; must be a power of two
+#define INODE_BLOCK_CACHE_SIZE 8 // Decoded inode blocks kept in memory
+#define ISYNC_THRESHOLD (MAX_INODES / 4)  // isync() once this many in-core inodes are dirty
 #define INODE_PTR_COUNT 16
 #define ROOT_INODE_NUM 0
 #define MAX_PATH_LENGTH 128
+#define INODE_INDEX_OFFSET 41  // Right after the block pointers
+#define INODE_INDIRECT_OFFSET 43
+#define INODE_DOUBLE_INDIRECT_OFFSET 45
+#define PTRS_PER_BLOCK (BLOCK_SIZE / 2)  // Block numbers in an indirect block
+#define MAX_FILE_BLOCKS (INODE_PTR_COUNT + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define INDIRECT_CACHE_SIZE 8  // Decoded indirect blocks kept in memory
 
 struct inode {
   unsigned int size;
@@ -18,16 +30,37 @@ struct inode {
   unsigned char flags;
   unsigned char link_count;
   unsigned short block_ptr[INODE_PTR_COUNT];
+  unsigned short index_block;  // Directories only: hashed name index, 0 if there isn't one
+  unsigned short indirect;  // Block of PTRS_PER_BLOCK more block pointers, 0 if none
+  unsigned short double_indirect;  // Block of pointers to indirect blocks, 0 if none
 
   unsigned int ref_count;  // in-core only
   unsigned int inode_num;
+  int dirty;  // Changed since it was last written with write_inode()
+  int hashed;
+  struct inode *hash_next;
+  struct inode *free_next, *free_prev;  // On the free list while ref_count is 0
+  pthread_rwlock_t lock;  // ilock()/ilock_shared(); guards the fields above ref_count
 };
+int get_block_num(int inode_num);
+int get_block_offset(int inode_num);
+int get_block_offset_bytes(int block_offset);
 struct inode *find_incore_free(void);
 struct inode *find_incore(unsigned int inode_num);
 void read_inode(struct inode *in, int inode_num);
 void write_inode(struct inode *in);
+void inode_pack(unsigned char *p, const struct inode *in);
+void inode_block_sync(void);
 struct inode *iget(int inode_num);
 void iput(struct inode *in);
+void imark_dirty(struct inode *in);
+void ilock(struct inode *in);
+void ilock_shared(struct inode *in);
+void iunlock(struct inode *in);
+void isync(void);
 struct inode *ialloc(void);
+int bmap(struct inode *in, int file_block, int create);
+struct inode *namei(char *path);
+int directory_make(char *path);
 
 #endif
\ No newline at end of file
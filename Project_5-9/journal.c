@@ -0,0 +1,569 @@
+#define _GNU_SOURCE  // For a writer-preferring rwlock
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "journal.h"
+#include "block.h"
+#include "bcache.h"
+#include "image.h"
+#include "inode.h"
+#include "pack.h"
+
+// ----------Metadata Journal-------------------------------------------------------------------------------------------
+
+  // Without this, directory_make() changes the inode map, the block map,
+  // two inodes and two directory blocks with separate writes, and a crash
+  // in between leaves the image half updated.
+
+  // With a journal open, no block write goes straight back to the image.
+  // journal_record() keeps the block for the running transaction instead.
+  // A commit writes all of the transaction's blocks to the journal file,
+  // behind a descriptor block and in front of a commit block, and syncs
+  // that one file. Only after that are the blocks copied to their real
+  // places in the image (a checkpoint). After a crash, journal_open()
+  // replays every transaction whose commit block made it to disk, so an
+  // operation's writes are there either all together or not at all.
+
+  // An operation brackets itself with journal_start()/journal_stop(). A
+  // commit waits until nobody is inside one, so a transaction never holds
+  // half an operation. Every operation since the last commit shares the next
+  // one, and with it the one fsync(): that's the group commit. The
+  // background thread commits every JOURNAL_COMMIT_MS; journal_sync() is for
+  // callers who need their changes durable right now.
+
+  // Blocks stay in memory from journal_record() until they're checkpointed,
+  // and image_read() patches them over what's in the image through
+  // journal_patch(), so everybody reads the latest version.
+
+  // A checkpoint writes the image and then forgets the blocks, so a read
+  // that got the image before the one and patched after the other would
+  // see neither. Readers hold checkpoint_lock shared from their pread()
+  // through their patch, and a checkpoint holds it exclusively. io_uring
+  // reads can't hold it while the kernel works, so they note
+  // journal_checkpoints when they're queued and read again if a
+  // checkpoint finished in the meantime.
+
+struct jblock {
+  int block_num;
+  unsigned int txn;  // Newest transaction that wrote it
+  struct jblock *hash_next;
+  unsigned char data[BLOCK_SIZE];
+};
+
+unsigned int journal_commits;  // How many commits reached the disk
+unsigned int journal_checkpoints;  // How many checkpoints have finished
+
+static int journal_fd = -1;
+static int active;
+static struct jblock *blocks[JOURNAL_HASH_SIZE];
+static struct jblock **running;  // Blocks written in the running transaction
+static int running_count, running_size;
+static unsigned int running_txn = 1;
+static unsigned int committed_txn;  // Newest transaction that's durable in the journal
+static off_t journal_size;  // Where the next transaction goes
+static int handles;  // Operations inside journal_start()/journal_stop()
+static int locked;  // A commit is waiting for handles to reach 0; no new ones
+static int stopping;
+static pthread_t committer;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;  // Everything above
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;  // One commit or checkpoint at a time
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP  // Or a steady stream of readers starves the checkpoint
+static pthread_rwlock_t checkpoint_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;  // Readers against a checkpoint; taken before journal_lock
+#else
+static pthread_rwlock_t checkpoint_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+static pthread_cond_t handles_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t unlocked = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static __thread int depth;  // journal_start() nests
+
+static unsigned int bucket(int block_num) {
+  return (unsigned int)block_num & (JOURNAL_HASH_SIZE - 1);
+}
+
+static struct jblock *find(int block_num) {
+  for (struct jblock *jb = blocks[bucket(block_num)]; jb != NULL; jb = jb->hash_next) {
+    if (jb->block_num == block_num) {
+      return jb;
+    }
+  }
+  return NULL;
+}
+
+static void drop_blocks(unsigned int through) {  // Forget blocks whose newest version is in the image now
+  for (int i = 0; i < JOURNAL_HASH_SIZE; i++) {
+    struct jblock **p = &blocks[i];
+    while (*p != NULL) {
+      struct jblock *jb = *p;
+      if (jb->txn <= through) {
+        *p = jb->hash_next;
+        free(jb);
+      }
+      else {
+        p = &jb->hash_next;
+      }
+    }
+  }
+}
+
+static unsigned int checksum(unsigned int h, const unsigned char *data) {  // FNV-1a, to spot a torn transaction
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    h = (h ^ data[i]) * 16777619u;
+  }
+  return h;
+}
+
+// ----------Recording and Reading Blocks-------------------------------------------------------------------------------------------
+
+static int add_running(struct jblock *jb) {  // Put jb in the running transaction, with journal_lock held
+  if (running_count == running_size) {
+    int size = running_size? running_size * 2: 64;
+    struct jblock **grown = realloc(running, size * sizeof *grown);
+    if (grown == NULL) {
+      return -1;
+    }
+    running = grown;
+    running_size = size;
+  }
+  running[running_count++] = jb;
+  jb->txn = running_txn;
+  return 0;
+}
+
+int journal_active(void) {  // Whether block writes have to go through the journal
+  return active;
+}
+
+// Called by bwrite() for every block. Returns 0 if there's no journal open
+// and the block should be written the usual way, 1 if the journal has it.
+int journal_record(int block_num, const unsigned char *data) {
+  if (!active) {
+    return 0;
+  }
+  pthread_mutex_lock(&journal_lock);
+  struct jblock *jb = find(block_num);
+  if (jb == NULL) {
+    jb = malloc(sizeof *jb);
+    if (jb == NULL) {
+      pthread_mutex_unlock(&journal_lock);
+      return 0;  // Better written unprotected than not at all
+    }
+    jb->block_num = block_num;
+    jb->txn = 0;
+    jb->hash_next = blocks[bucket(block_num)];
+    blocks[bucket(block_num)] = jb;
+  }
+  memcpy(jb->data, data, BLOCK_SIZE);  // Even if it can't join the transaction, journal_patch() mustn't hand out anything older
+  if (jb->txn != running_txn && add_running(jb) == -1) {  // First write to it in this transaction
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&journal_lock);
+  return 1;
+}
+
+// Overwrite whatever blocks of buf (count blocks from block_num, as just
+// read from the image) the journal has a newer version of.
+void journal_patch(int block_num, int count, unsigned char *buf) {
+  if (!active) {
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  for (int i = 0; i < count; i++) {
+    struct jblock *jb = find(block_num + i);
+    if (jb != NULL) {
+      memcpy(buf + i * BLOCK_SIZE, jb->data, BLOCK_SIZE);
+    }
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Around a read of the image and its journal_patch(), so no checkpoint
+// happens in between.
+void journal_read_begin(void) {
+  pthread_rwlock_rdlock(&checkpoint_lock);
+}
+
+void journal_read_end(void) {
+  pthread_rwlock_unlock(&checkpoint_lock);
+}
+
+// ----------Handles-------------------------------------------------------------------------------------------
+
+void journal_start(void) {
+  if (!active || depth++ > 0) {
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  while (locked) {
+    pthread_cond_wait(&unlocked, &journal_lock);
+  }
+  handles++;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_stop(void) {
+  if (depth == 0 || --depth > 0) {
+    return;
+  }
+  pthread_mutex_lock(&journal_lock);
+  if (--handles == 0) {
+    pthread_cond_broadcast(&handles_done);
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// ----------Commit-------------------------------------------------------------------------------------------
+
+static int write_all(off_t offset, const unsigned char *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(journal_fd, buf + done, len - done, offset + done);
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Write the running transaction to the journal and sync it. Called with
+// commit_lock held, and not from inside a handle.
+static int commit(void) {
+  pthread_mutex_lock(&journal_lock);
+  if (running_count == 0 && handles == 0) {
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+  }
+  locked = 1;  // Let the operations in progress finish, but don't start new ones
+  while (handles > 0) {
+    pthread_cond_wait(&handles_done, &journal_lock);
+  }
+  pthread_mutex_unlock(&journal_lock);
+
+  isync();  // Nothing is half done now, so the in-core inodes go in too
+
+  pthread_mutex_lock(&journal_lock);
+  int count = running_count;
+  unsigned int txn = running_txn;
+  unsigned char *data = count > 0? malloc((size_t)count * BLOCK_SIZE): NULL;
+  int *nums = count > 0? malloc(count * sizeof *nums): NULL;
+  if (count > 0 && (data == NULL || nums == NULL)) {
+    locked = 0;
+    pthread_cond_broadcast(&unlocked);
+    pthread_mutex_unlock(&journal_lock);
+    free(data);
+    free(nums);
+    return -1;  // They stay in the running transaction for next time
+  }
+  for (int i = 0; i < count; i++) {  // Copies, so the next transaction can change them while we write
+    nums[i] = running[i]->block_num;
+    memcpy(data + (size_t)i * BLOCK_SIZE, running[i]->data, BLOCK_SIZE);
+  }
+  running_count = 0;
+  running_txn++;
+  locked = 0;
+  pthread_cond_broadcast(&unlocked);
+  pthread_mutex_unlock(&journal_lock);
+  if (count == 0) {
+    return 0;
+  }
+
+  // Descriptor, its blocks, and so on; then the commit block
+  unsigned char block[BLOCK_SIZE];
+  off_t offset = journal_size;
+  unsigned int sum = 2166136261u;
+  int failed = 0;
+  for (int first = 0; first < count && !failed; first += JOURNAL_DESCRIPTOR_SLOTS) {
+    int n = count - first < JOURNAL_DESCRIPTOR_SLOTS? count - first: JOURNAL_DESCRIPTOR_SLOTS;
+    memset(block, 0, BLOCK_SIZE);
+    write_u32(block, JOURNAL_MAGIC);
+    write_u32(block + 4, txn);
+    write_u32(block + 8, n);
+    for (int i = 0; i < n; i++) {
+      write_u32(block + 12 + i * 4, nums[first + i]);
+      sum = checksum(sum, data + (size_t)(first + i) * BLOCK_SIZE);
+    }
+    failed = write_all(offset, block, BLOCK_SIZE) == -1 ||
+      write_all(offset + BLOCK_SIZE, data + (size_t)first * BLOCK_SIZE, (size_t)n * BLOCK_SIZE) == -1;
+    offset += (off_t)(n + 1) * BLOCK_SIZE;
+  }
+  memset(block, 0, BLOCK_SIZE);
+  write_u32(block, JOURNAL_COMMIT_MAGIC);
+  write_u32(block + 4, txn);
+  write_u32(block + 8, count);
+  write_u32(block + 12, sum);
+  failed = failed || write_all(offset, block, BLOCK_SIZE) == -1 || fdatasync(journal_fd) == -1;
+  free(data);
+  if (failed) {  // Replay stops short of a transaction without its commit block, so it goes again next time
+    pthread_mutex_lock(&journal_lock);
+    for (int i = 0; i < count; i++) {
+      struct jblock *jb = find(nums[i]);
+      if (jb != NULL && jb->txn == txn && add_running(jb) == -1) {  // Not already back in by a newer write
+        image_write(nums[i], 1, jb->data);  // Not atomic with the rest any more, but not lost either
+      }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    free(nums);
+    return -1;
+  }
+  free(nums);
+
+  journal_size = offset + BLOCK_SIZE;
+  pthread_mutex_lock(&journal_lock);
+  committed_txn = txn;
+  journal_commits++;
+  pthread_mutex_unlock(&journal_lock);
+  return 0;
+}
+
+// Make everything written so far durable. Whoever gets commit_lock first
+// commits for everybody waiting behind them, who then find there's
+// nothing left to do.
+int journal_sync(void) {
+  if (!active) {
+    return 0;
+  }
+  pthread_mutex_lock(&journal_lock);
+  unsigned int target = running_count > 0 || handles > 0? running_txn: committed_txn;
+  pthread_mutex_unlock(&journal_lock);
+
+  pthread_mutex_lock(&commit_lock);
+  int result = 0;
+  pthread_mutex_lock(&journal_lock);
+  int covered = committed_txn >= target;
+  pthread_mutex_unlock(&journal_lock);
+  if (!covered) {
+    result = commit();
+  }
+  pthread_mutex_unlock(&commit_lock);
+  return result;
+}
+
+// ----------Replay and Checkpoint-------------------------------------------------------------------------------------------
+
+static int read_all(off_t offset, unsigned char *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(journal_fd, buf + done, len - done, offset + done);
+    if (n <= 0) {
+      return -1;  // Including a journal that ends early
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Copy every committed transaction in the journal file to the image, in
+// order. Stops at the first one that's incomplete or doesn't check out;
+// that (and anything after it) never committed. Returns how many it copied.
+static int replay(void) {
+  off_t offset = 0;
+  int replayed = 0;
+  unsigned char block[BLOCK_SIZE];
+  for (;;) {
+    unsigned char *data = NULL;
+    int *nums = NULL;
+    int count = 0;
+    unsigned int txn = 0;
+    unsigned int sum = 2166136261u;
+    int good = 0;
+    off_t at = offset;
+    while (read_all(at, block, BLOCK_SIZE) == 0) {
+      unsigned int magic = read_u32(block);
+      if (magic == JOURNAL_COMMIT_MAGIC) {
+        good = count > 0 && read_u32(block + 4) == txn && (int)read_u32(block + 8) == count && read_u32(block + 12) == sum;
+        at += BLOCK_SIZE;
+        break;
+      }
+      int n = read_u32(block + 8);
+      if (magic != JOURNAL_MAGIC || (count > 0 && read_u32(block + 4) != txn) || n <= 0 || n > JOURNAL_DESCRIPTOR_SLOTS) {
+        break;
+      }
+      txn = read_u32(block + 4);
+      unsigned char *grown_data = realloc(data, (size_t)(count + n) * BLOCK_SIZE);
+      int *grown_nums = grown_data? realloc(nums, (count + n) * sizeof *nums): NULL;
+      if (grown_data != NULL) {
+        data = grown_data;
+      }
+      if (grown_nums == NULL) {
+        break;
+      }
+      nums = grown_nums;
+      for (int i = 0; i < n; i++) {
+        nums[count + i] = read_u32(block + 12 + i * 4);
+      }
+      if (read_all(at + BLOCK_SIZE, data + (size_t)count * BLOCK_SIZE, (size_t)n * BLOCK_SIZE) == -1) {
+        break;
+      }
+      for (int i = 0; i < n; i++) {
+        sum = checksum(sum, data + (size_t)(count + i) * BLOCK_SIZE);
+      }
+      count += n;
+      at += (off_t)(n + 1) * BLOCK_SIZE;
+    }
+    for (int i = 0; good && i < count; i++) {
+      good = image_write(nums[i], 1, data + (size_t)i * BLOCK_SIZE) == 0;
+    }
+    free(data);
+    free(nums);
+    if (!good) {
+      return replayed;
+    }
+    replayed++;
+    offset = at;
+  }
+}
+
+// Copy what's committed to its home in the image, then empty the journal.
+// Called with commit_lock held.
+static int checkpoint(void) {
+  pthread_mutex_lock(&journal_lock);
+  unsigned int through = committed_txn;
+  pthread_mutex_unlock(&journal_lock);
+  if (journal_size == 0) {
+    return 0;
+  }
+  pthread_rwlock_wrlock(&checkpoint_lock);
+  replay();  // The journal has exactly what each transaction committed, which may be older than what's in memory
+  if (fsync(image_fd) == -1 || ftruncate(journal_fd, 0) == -1) {
+    pthread_rwlock_unlock(&checkpoint_lock);
+    return -1;  // Still in the journal, so nothing is lost
+  }
+  journal_size = 0;
+  pthread_mutex_lock(&journal_lock);
+  drop_blocks(through);
+  pthread_mutex_unlock(&journal_lock);
+  __atomic_store_n(&journal_checkpoints, journal_checkpoints + 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&checkpoint_lock);
+  return 0;
+}
+
+int journal_checkpoint(void) {  // Commit and checkpoint now instead of waiting for the background thread
+  if (!active) {
+    return 0;
+  }
+  pthread_mutex_lock(&commit_lock);
+  int result = commit();
+  if (result == 0) {
+    result = checkpoint();
+  }
+  pthread_mutex_unlock(&commit_lock);
+  return result;
+}
+
+// ----------Background Thread-------------------------------------------------------------------------------------------
+
+static void *journal_thread(void *unused) {
+  (void)unused;
+  pthread_mutex_lock(&journal_lock);
+  while (!stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&wake, &journal_lock, &until);
+    if (stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    pthread_mutex_lock(&commit_lock);
+    commit();
+    if (journal_size >= (off_t)JOURNAL_CHECKPOINT_BLOCKS * BLOCK_SIZE) {
+      checkpoint();
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    pthread_mutex_lock(&journal_lock);
+  }
+  pthread_mutex_unlock(&journal_lock);
+  return NULL;
+}
+
+// ----------Opening and Closing-------------------------------------------------------------------------------------------
+
+// Start journaling the open image to filename, first replaying anything a
+// crash left in it. Call it right after image_open() (and mkfs(), if you're
+// making a new image). Mapped images can't be journaled, since their
+// writes land in the image as soon as they're made.
+int journal_open(char *filename) {
+  if (active || image_map != NULL) {
+    return -1;
+  }
+  journal_fd = open(filename, O_RDWR | O_CREAT, 0600);
+  if (journal_fd == -1) {
+    return -1;
+  }
+  isync();
+  bsync();  // Anything written before now goes out the old way
+  if (replay() > 0) {
+    fsync(image_fd);
+    bcache_reset();  // What's cached may be older than what we just replayed
+    image_generation++;
+  }
+  if (ftruncate(journal_fd, 0) == -1) {
+    close(journal_fd);
+    journal_fd = -1;
+    return -1;
+  }
+  journal_size = 0;
+  running_count = 0;
+  committed_txn = running_txn - 1;
+  stopping = 0;
+  active = 1;
+  if (pthread_create(&committer, NULL, journal_thread, NULL) != 0) {
+    active = 0;
+    close(journal_fd);
+    journal_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int journal_close(void) {  // Commit, checkpoint, and go back to writing blocks straight through
+  if (!active) {
+    return 0;
+  }
+  pthread_mutex_lock(&journal_lock);
+  stopping = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&journal_lock);
+  pthread_join(committer, NULL);
+
+  int result = journal_checkpoint();
+  pthread_mutex_lock(&journal_lock);
+  active = 0;
+  drop_blocks(~0u);
+  running_count = 0;
+  pthread_mutex_unlock(&journal_lock);
+  close(journal_fd);
+  journal_fd = -1;
+  return result;
+}
+
+// The image is being wiped (image_zero()), so nothing in the journal
+// applies to it any more.
+void journal_discard(void) {
+  if (!active) {
+    return;
+  }
+  pthread_mutex_lock(&commit_lock);
+  pthread_mutex_lock(&journal_lock);
+  drop_blocks(~0u);
+  running_count = 0;
+  running_txn++;
+  committed_txn = running_txn - 1;
+  pthread_mutex_unlock(&journal_lock);
+  if (ftruncate(journal_fd, 0) == 0) {
+    journal_size = 0;
+  }
+  pthread_mutex_unlock(&commit_lock);
+}
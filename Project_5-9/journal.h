@@ -0,0 +1,27 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC 0x534a4e4cu         // "SJNL", a descriptor block
+#define JOURNAL_COMMIT_MAGIC 0x534a434du  // "SJCM", a commit block
+#define JOURNAL_HASH_SIZE 256             // Buckets for blocks waiting to be checkpointed
+#define JOURNAL_DESCRIPTOR_SLOTS ((BLOCK_SIZE - 12) / 4)  // Block numbers per descriptor block
+#define JOURNAL_COMMIT_MS 10              // The background thread commits this often
+#define JOURNAL_CHECKPOINT_BLOCKS 1024    // and checkpoints once the journal is this big
+
+int journal_open(char *filename);
+int journal_close(void);
+void journal_start(void);
+void journal_stop(void);
+int journal_sync(void);
+int journal_checkpoint(void);
+void journal_discard(void);
+int journal_active(void);
+int journal_record(int block_num, const unsigned char *data);
+void journal_patch(int block_num, int count, unsigned char *buf);
+void journal_read_begin(void);
+void journal_read_end(void);
+
+extern unsigned int journal_commits;
+extern unsigned int journal_checkpoints;
+
+#endif
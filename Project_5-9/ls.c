@@ -5,12 +5,16 @@
 void ls(void)
 {
   struct directory *dir;
-  struct directory_entry ent;
+  struct directory_entry ents[ENTRIES_PER_BLOCK];
+  int n;
 
   dir = directory_open(0);
+  if (dir == NULL)
+    return;
 
-  while (directory_get(dir, &ent) != -1)
-    printf("%d %s\n", ent.inode_num, ent.name);
+  while ((n = directory_get_many(dir, ents, ENTRIES_PER_BLOCK)) > 0)
+    for (int i = 0; i < n; i++)
+      printf("%d %s\n", ents[i].inode_num, ents[i].name);
 
   directory_close(dir);
 }
\ No newline at end of file
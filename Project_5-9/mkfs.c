@@ -4,63 +4,68 @@
 #include "image.h"
 #include "inode.h"
 #include "pack.h"
+#include "aio.h"
+#include "stats.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 
-void mkfs(void) {
-  for(int i = 0; 1 < NUM_OF_BLOCKS; i++) {
-    unsigned char block[BLOCK_SIZE];
-    write(image_fd, block, BLOCK_SIZE);
+// mkfs() used to write() every block of the image one at a time and then
+// call alloc() for each reserved block, reading and writing the block map
+// every time. Now the image is zeroed by resizing it (so it's sparse and
+// takes no time at all), and all the metadata (the inode map, the block
+// map, and the root directory's inode and data block) is built in memory
+// and written with a single bwrite_range().
+
+// Returns 0, or -1 if num_blocks is too small to hold the metadata, too big
+// for the block map, or the image can't be resized.
+int mkfs(int num_blocks) {
+  if (num_blocks < MKFS_BLOCKS || num_blocks > MAP_BITS) {
+    return -1;
   }
-  for(int i = 0; i < 7; i++) {
-    alloc();
+  if (image_zero(num_blocks) == -1) {
+    return -1;
   }
 
+  static unsigned char blocks[MKFS_BLOCKS][BLOCK_SIZE]; // Everything up to and including the root directory
+  memset(blocks, 0, sizeof blocks);
+
+  struct free_map map; // Only for free_map_set_run(), which sets whole words at a time
+  free_map_load(&map, blocks[FREE_DATA_BLOCK_NUM]);
+  free_map_set_run(&map, blocks[FREE_DATA_BLOCK_NUM], 0, MKFS_BLOCKS, 1); // The reserved blocks and the root directory's block are in use,
+  free_map_set_run(&map, blocks[FREE_DATA_BLOCK_NUM], num_blocks, MAP_BITS - num_blocks, 1); // and so is anything past the end of the image.
 
 // ## Create the Root Directory
 // Broken down:
 
-  struct inode *inode = ialloc(); // 1. Call ialloc() to get a new inode.
-
-// We'll need the inode_num later to add it to the directory!
-
-  int block_num = alloc(); // 2. Call alloc() to get a new data block.
-
-// This will hold the directory entries.
+  set_free(blocks[FREE_INODE_BLOCK_NUM], ROOT_INODE_NUM, 1); // 1. Allocate the root inode.
 
-// Be sure to note the returned block number because we're going to need to write to it in just a minute!
+  int block_num = ROOT_DIRECTORY_BLOCK; // 2. Its data block is the first one after the reserved blocks.
 
-  struct inode *root = iget(inode->inode_num); // 3. Initialize the inode returned from ialloc(), above.
+  struct inode root = {0}; // 3. Initialize the root inode.
   
-  root->flags = DIRECTORY_FLAG; //   - flags needs to be set to 2.
+  root.flags = DIRECTORY_FLAG; //   - flags needs to be set to 2.
 
-  root->size = DIRECTORY_SIZE; //   - size needs to be set to the byte size of the directory. Since we have two entries (. and ..) and each is 32 bytes, the size must be 64 bytes.
+  root.size = DIRECTORY_SIZE; //   - size needs to be set to the byte size of the directory. Since we have two entries (. and ..) and each is 32 bytes, the size must be 64 bytes.
 
-  root->block_ptr[0] = block_num;//   - block_ptr[0] needs to point to the data block we just got from alloc(), above.
+  root.block_ptr[0] = block_num;//   - block_ptr[0] needs to point to the data block we just got from alloc(), above.
 
-  unsigned char block[BLOCK_SIZE];// 4. Make an unsigned char block[BLOCK_SIZE] array that you can populate with the new directory data.
+  inode_pack(blocks[get_block_num(ROOT_INODE_NUM)] + get_block_offset_bytes(get_block_offset(ROOT_INODE_NUM)), &root);
 
-// We're going to pack the . and .. directory entries in here.
-
-  write_u16(block, inode->inode_num); // 5. Add the directory entries. You're going to need to math it out.
-
-// You know the first two-byte value is the inode number, so you can pack that in with write_16(). Remember that for the root inode, both the . and .. inode numbers are the same as the root inode itself (i.e. the inode_num you got back from ialloc()).
+  unsigned char *block = blocks[block_num];// 4. The directory data block we populate with the new directory data.
 
-  strcpy((char*)block + FILE_OFFSET, "."); // The next up-to-16 bytes are the file name. You can copy that in with strcpy(). (You might have to cast some arguments to char*.)
+// We're going to pack the . and .. directory entries in here.
 
-// You have to do this process for both . and .. entries.
-  write_u16(block + FILE_OFFSET + DIRECTORY_ENTRY_SIZE, inode->inode_num);
-  strcpy((char*)block + FILE_OFFSET, ".");
-// Compute the offsets into your in-memory block and copy the data there.
+  write_u16(block, ROOT_INODE_NUM); // 5. Add the directory entries. For the root, both . and .. are the root inode itself.
 
-  bwrite(block_num, block); // 6. Write the directory data block back out to disk with bwrite().
+  strcpy((char*)block + FILE_OFFSET, "."); // The next up-to-16 bytes are the file name.
 
-  iput(root); // 7. Call iput() to write the new directory inode out to disk and free up the in-core inode.
+  write_u16(block + DIRECTORY_ENTRY_SIZE, ROOT_INODE_NUM);
+  strcpy((char*)block + DIRECTORY_ENTRY_SIZE + FILE_OFFSET, "..");
 
-// At this point, we should have a root directory. But other than doing a raw iget() and bread() to get the block, we don't have a nice way of interfacing with it.
+  return bwrite_range(0, MKFS_BLOCKS, (unsigned char *)blocks); // 6. Write all of it out in one go.
 
-// Also, the root directory inode number should be 0, since it's the first one we've allocated.
+// At this point, we should have a root directory, with inode number 0.
 }
 
 // ## Directory Open/Read/Close Ops
@@ -78,51 +83,128 @@ struct directory *directory_open(int inode_num) {
 
   directory_struct->offset = 0; // 5. Initialize offset to 0.
 
+  directory_struct->block_index = -1; // Nothing decoded yet
+  directory_struct->valid_to = 0;
+  directory_struct->readahead = 0;
+
   return directory_struct; // Return the pointer to the struct.
 }
 // ## Reading a Directory
 
-// So the steps will be:
-int directory_get(struct directory *dir, struct directory_entry *ent) {
-  if (dir->offset >= dir->inode->size) {// 1. Check the offset against the size of the directory. If the offset is greater-than or equal-to the directory size (in its inode), we must be off the end of the directory. If so, return -1 to indicate that.
-    return -1;
-  }
+  // directory_get() used to bread() a whole block for every 32-byte entry it
+  // returned. Now the struct directory keeps the entries of the block it's in
+  // already decoded, and only reads the next block when offset crosses into it.
+
+  // A scan that goes through the blocks in order also starts reading the
+  // next DIRECTORY_READAHEAD of them (breadahead()), so by the time it gets
+  // there they're usually already in the buffer cache.
+
+// Make sure dir->entries holds the data block that dir->offset falls in.
+static int directory_load_block(struct directory *dir) {
   int data_block_index = dir->offset / BLOCK_SIZE; // 2. Compute the block in the directory we need to read. The directory file itself might span multiple data blocks if there are enough entries in it. Remember that a block only holds 128 entries. (When we just create it, it will only be one block, but we might as well do this math now so it will work later.)
+  if (data_block_index == dir->block_index && dir->offset < dir->valid_to) {
+    return 0; // Already have it, and nothing's been added to it we'd miss
+  }
+  int sequential = data_block_index == dir->block_index + 1;
 
   // 3. We need to read the appropriate data block in so we can extract the directory entry from it.
   // But what we have, the data_block_index, is giving us the index into the block_ptr array in the directory's inode.
 
-  // Sheesh! More indirection; there's a shocker.
-
-  // So in order to get the block number to read, we have to look that up. Luckily, we have the inode in the struct directory * that was passed into this function:
-
-  int data_block_num = dir->inode->block_ptr[data_block_index];
-  unsigned char block[BLOCK_SIZE];
-  // // and finally...
-
-  bread(data_block_num, block);
-  // And there we've read the block containing the directory entry we want into memory.
+  // So in order to get the block number to read, we have to look that up. Luckily, we have the inode in the struct directory * that was passed into this function.
+  // Past the direct pointers, bmap() follows the indirect blocks for us.
 
-  int offset_in_block = dir->offset % BLOCK_SIZE; // 4. Compute the offset of the directory entry in the block we just read.
-
-  // We know the absolute offset of where we are in the file (passed in the struct directory.
-
-  // We know the size of the block, 4096 bytes.
+  int data_block_num = bmap(dir->inode, data_block_index, 0);
+  if (data_block_num <= 0) {
+    return -1;
+  }
 
-  // So we can compute the offset within the block:
+  const unsigned char *block = bget(data_block_num); // Borrow it straight out of the cache (or the mapping) instead of copying it
+  if (block == NULL) {
+    return -1;
+  }
 
-  // offset_in_block = offset % 4096;
-  ent->inode_num = read_u16(block + offset_in_block); // 5. Extract the directory entry from the raw data in the block into the struct directory_entry * we passed in.
+  for (int i = 0; i < ENTRIES_PER_BLOCK; i++) { // 5. Extract the directory entries from the raw data in the block, all of them at once.
+    const unsigned char *raw = block + i * DIRECTORY_ENTRY_SIZE;
+    struct directory_entry *ent = &dir->entries[i];
+    ent->inode_num = read_u16(raw);
+    memcpy(ent->name, raw + FILE_OFFSET, FILE_NAME_SIZE - 1);
+    ent->name[FILE_NAME_SIZE - 1] = '\0'; // In case the name filled the whole field
+  }
+  brelse(block);
+
+  dir->block_index = data_block_index;
+  dir->valid_to = dir->inode->size;
+
+  int num_blocks = (dir->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (int i = 1; sequential && i <= DIRECTORY_READAHEAD && data_block_index + i < num_blocks; i++) {
+    int next = bmap(dir->inode, data_block_index + i, 0);
+    if (next > 0) {
+      breadahead(next);
+      dir->readahead = 1;
+    }
+  }
+  bsubmit();
+  return 0;
+}
 
-  // Now we have the data in our block array, and we've computed where it starts with offset_in_block. We just have to deserialize it.
+// Called before the inode lock: if we're about to move to another block,
+// whatever we read ahead goes into the cache now. bwait() runs every
+// callback this thread has pending, which is no thing to do holding a lock.
+static void directory_wait_readahead(struct directory *dir) {
+  if (dir->readahead && dir->offset / BLOCK_SIZE != (unsigned int)dir->block_index) {
+    bwait();
+    dir->readahead = 0;
+  }
+}
 
-  // Use read_16() to extract the inode number and store it in ent->inode_num.
+// So the steps will be:
+// Each call holds the directory's inode lock shared, so an entry being
+// added by directory_make() is either all there or not there yet.
+int directory_get(struct directory *dir, struct directory_entry *ent) {
+  STAT_TIME(HIST_DIRECTORY_GET);
+  STAT_COUNT(STAT_DIRECTORY_GET, 1);
+  directory_wait_readahead(dir);
+  ilock_shared(dir->inode);
+  if (dir->offset >= dir->inode->size || directory_load_block(dir) == -1) {// 1. Check the offset against the size of the directory. If the offset is greater-than or equal-to the directory size (in its inode), we must be off the end of the directory. If so, return -1 to indicate that.
+    iunlock(dir->inode);
+    return -1;
+  }
 
-  strcpy(ent->name, (char*)block + offset_in_block + offset_in_block + FILE_OFFSET); // Use strcpy() to extract the file name and store it in ent->name. You might have to do some casting to char *.
+  int offset_in_block = dir->offset % BLOCK_SIZE; // 4. Compute the offset of the directory entry in the block we just read.
+  *ent = dir->entries[offset_in_block / DIRECTORY_ENTRY_SIZE];
 
   dir->offset += DIRECTORY_ENTRY_SIZE;
+  iunlock(dir->inode);
   return 0;
-  // Just that!
+}
+
+// Like directory_get(), but fills in up to n entries at once. Returns how
+// many it got, which is 0 at the end of the directory. The lock is taken
+// once per block, so the readahead can land in between.
+int directory_get_many(struct directory *dir, struct directory_entry *ents, int n) {
+  int got = 0;
+  while (got < n) {
+    directory_wait_readahead(dir);
+    ilock_shared(dir->inode);
+    if (dir->offset >= dir->inode->size || directory_load_block(dir) == -1) {
+      iunlock(dir->inode);
+      break;
+    }
+    int first = (dir->offset % BLOCK_SIZE) / DIRECTORY_ENTRY_SIZE;
+    int count = ENTRIES_PER_BLOCK - first; // The rest of this block,
+    int left = (dir->valid_to - dir->offset + DIRECTORY_ENTRY_SIZE - 1) / DIRECTORY_ENTRY_SIZE;
+    if (count > left) { // but not past the end of the directory
+      count = left;
+    }
+    if (count > n - got) { // or of the array we were handed
+      count = n - got;
+    }
+    memcpy(ents + got, dir->entries + first, count * sizeof *ents);
+    got += count;
+    dir->offset += count * DIRECTORY_ENTRY_SIZE;
+    iunlock(dir->inode);
+  }
+  return got;
 }
 
 // ### Closing a Directory
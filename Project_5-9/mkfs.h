@@ -1,26 +1,40 @@
 #ifndef MKFS_H
 #define MKFS_H
 
-#define NUM_OF_BLOCKS 1024
+#include "block.h"
+#include "inode.h"
+
+#define NUM_OF_BLOCKS 1024          // Default image size for mkfs()
+#define RESERVED_BLOCKS (INODE_FIRST_BLOCK + INODE_BLOCK_COUNT)  // Superblock, inode map, block map, and the inode blocks
+#define ROOT_DIRECTORY_BLOCK RESERVED_BLOCKS
+#define MKFS_BLOCKS (RESERVED_BLOCKS + 1)  // Blocks mkfs() writes: the reserved ones and the root directory's
 #define DIRECTORY_FLAG 2
 #define DIRECTORY_ENTRY_SIZE 32
 #define DIRECTORY_SIZE 64
 #define FILE_OFFSET 2
+#define FILE_NAME_SIZE 16
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE / DIRECTORY_ENTRY_SIZE)
+#define DIRECTORY_READAHEAD 4  // Blocks read ahead of a directory scan
+
+int mkfs(int num_blocks);
 
-void mkfs(void);
+struct directory_entry {
+  unsigned int inode_num;
+  char name[FILE_NAME_SIZE];
+};
 
 struct directory {
   struct inode *inode;
   unsigned int offset;
-};
-
-struct directory_entry {
-  unsigned int inode_num;
-  char name[16];
+  int block_index;  // Which of the directory's blocks is decoded in entries, -1 for none
+  unsigned int valid_to;  // Directory size when it was decoded; entries from here on came later
+  int readahead;  // We've started breadahead()s that no bwait() has installed yet
+  struct directory_entry entries[ENTRIES_PER_BLOCK];
 };
 
 struct directory *directory_open(int inode_num);
 int directory_get(struct directory *dir, struct directory_entry *ent);
+int directory_get_many(struct directory *dir, struct directory_entry *ents, int n);
 void directory_close(struct directory *d);
 
 #endif
\ No newline at end of file
@@ -1,20 +1,33 @@
+#include <string.h>
+#include <stdint.h>
 #include "pack.h"
-unsigned int read_u32(void *addr)
+
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#endif
+
+unsigned int read_u32(const void *addr)
 {
-unsigned char *bytes = addr;
+const unsigned char *bytes = addr;
 return (bytes[0] << 24) |
 (bytes[1] << 16) |
 (bytes[2] << 8) |
 (bytes[3] << 0);
 }
-unsigned short read_u16(void *addr)
+unsigned short read_u16(const void *addr)
 {
-unsigned char *bytes = addr;
+const unsigned char *bytes = addr;
 return (bytes[0] << 8) | (bytes[1] << 0);
 }
-unsigned char read_u8(void *addr)
+unsigned char read_u8(const void *addr)
 {
-unsigned char *bytes = addr;
+const unsigned char *bytes = addr;
 return bytes[0];
 }
 void write_u32(void *addr, unsigned long value)
@@ -35,4 +48,90 @@ void write_u8(void *addr, unsigned char value)
 {
 unsigned char *bytes = addr;
 bytes[0] = value;
-}
\ No newline at end of file
+}
+// ----------Arrays-------------------------------------------------------------------------------------------
+
+  // Runs of big-endian values, like the block pointers in an inode or a
+  // whole indirect block, are unpacked in bulk instead of one read_u16() at
+  // a time. Going either way between disk order and host order is the same
+  // byte swap, so reads and writes share swap16() and swap32(). On a
+  // big-endian host there is nothing to swap and they're plain copies.
+
+static void swap16(void *dst, const void *src, int n) {
+  unsigned char *d = dst;
+  const unsigned char *s = src;
+  int i = 0;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  memcpy(d, s, n * 2);
+  i = n;
+#elif defined(__SSE2__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 2));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(d + i * 2), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= n; i += 8) {
+    vst1q_u8(d + i * 2, vrev16q_u8(vld1q_u8(s + i * 2)));
+  }
+#endif
+  for (; i < n; i++) {
+    uint16_t v;
+    memcpy(&v, s + i * 2, sizeof v);
+    v = __builtin_bswap16(v);
+    memcpy(d + i * 2, &v, sizeof v);
+  }
+}
+
+static void swap32(void *dst, const void *src, int n) {
+  unsigned char *d = dst;
+  const unsigned char *s = src;
+  int i = 0;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  memcpy(d, s, n * 4);
+  i = n;
+#elif defined(__SSSE3__)
+  const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 4));
+    _mm_storeu_si128((__m128i *)(d + i * 4), _mm_shuffle_epi8(v, order));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= n; i += 4) { // No byte shuffle, so swap the bytes in each half, then the halves
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 4));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+    _mm_storeu_si128((__m128i *)(d + i * 4), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 4 <= n; i += 4) {
+    vst1q_u8(d + i * 4, vrev32q_u8(vld1q_u8(s + i * 4)));
+  }
+#endif
+  for (; i < n; i++) {
+    uint32_t v;
+    memcpy(&v, s + i * 4, sizeof v);
+    v = __builtin_bswap32(v);
+    memcpy(d + i * 4, &v, sizeof v);
+  }
+}
+
+void read_u16_array(unsigned short *dst, const void *src, int n)
+{
+  swap16(dst, src, n);
+}
+
+void write_u16_array(void *dst, const unsigned short *src, int n)
+{
+  swap16(dst, src, n);
+}
+
+void read_u32_array(unsigned int *dst, const void *src, int n)
+{
+  swap32(dst, src, n);
+}
+
+void write_u32_array(void *dst, const unsigned int *src, int n)
+{
+  swap32(dst, src, n);
+}
@@ -1,9 +1,13 @@
 #ifndef PACK_H
 #define PACK_H
-unsigned int read_u32(void *addr);
-unsigned short read_u16(void *addr);
-unsigned char read_u8(void *addr);
+unsigned int read_u32(const void *addr);
+unsigned short read_u16(const void *addr);
+unsigned char read_u8(const void *addr);
 void write_u32(void *addr, unsigned long value);
 void write_u16(void *addr, unsigned int value);
 void write_u8(void *addr, unsigned char value);
+void read_u16_array(unsigned short *dst, const void *src, int n);
+void write_u16_array(void *dst, const unsigned short *src, int n);
+void read_u32_array(unsigned int *dst, const void *src, int n);
+void write_u32_array(void *dst, const unsigned int *src, int n);
 #endif
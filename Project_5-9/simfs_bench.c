@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "stats.h"
+
+// Microbenchmarks for the simfs library. Each one times a lot of samples
+// of an operation and prints a line with its throughput and its p50/p99
+// latency, as CSV (the default) or JSON, so runs can be saved and
+// compared.
+
+// Operations that take a few nanoseconds are timed in batches of
+// BENCH_BATCH and each sample is the batch's time per operation, so the
+// clock isn't most of what we measure.
+
+// The library is built without optimization by default; for numbers that
+// mean anything, build it with make CFLAGS="-Wall -Wextra -O2" bench.
+
+#define BENCH_IMAGE "bench_file.img"
+#define BENCH_BATCH 64
+#define BENCH_SAMPLES 10000
+#define BENCH_MAX_SAMPLES (1 << 17)
+#define BENCH_ROUNDS 3          // Fill-it-up benchmarks run this many times
+#define BENCH_SCANS 200         // Full scans of the big directory
+#define BENCH_MKFS_ROUNDS 20    // mkfs() calls per image size
+
+static double samples[BENCH_MAX_SAMPLES];  // Nanoseconds per operation
+static int sample_count;
+static unsigned long long bench_started;
+static long bench_ops;
+static int json, results;
+static volatile int sink;  // Keeps the compiler from dropping calls whose results we ignore
+
+static void bench_start(void) {
+  sample_count = 0;
+  bench_ops = 0;
+  bench_started = simfs_stats_now();
+}
+
+static void sample(unsigned long long start, int ops) {  // ops operations just finished, starting at start
+  if (sample_count < BENCH_MAX_SAMPLES) {
+    samples[sample_count++] = (double)(simfs_stats_now() - start) / ops;
+  }
+  bench_ops += ops;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(double pct) {  // Of the sorted samples, by nearest rank
+  int rank = (int)(pct / 100.0 * sample_count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  return samples[rank - 1];
+}
+
+// Print a result line for everything sampled since bench_start(). The
+// elapsed time includes the untimed setup between samples, so ops/sec is
+// worked out from the samples themselves.
+static void bench_finish(const char *name) {
+  if (sample_count == 0) {
+    return;
+  }
+  double timed = 0;
+  for (int i = 0; i < sample_count; i++) {
+    timed += samples[i];
+  }
+  timed = timed / sample_count * bench_ops;  // Nanoseconds spent in the operations
+  qsort(samples, sample_count, sizeof samples[0], compare_doubles);
+  double ops_per_sec = timed > 0? bench_ops / (timed / 1e9): 0;
+  double wall = (simfs_stats_now() - bench_started) / 1e9;
+  if (json) {
+    printf("%s\n  {\"name\": \"%s\", \"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"p50_ns\": %.1f, \"p99_ns\": %.1f}",
+      results? ",": "[", name, bench_ops, wall, ops_per_sec, percentile(50), percentile(99));
+  }
+  else {
+    if (results == 0) {
+      printf("name,ops,seconds,ops_per_sec,p50_ns,p99_ns\n");
+    }
+    printf("%s,%ld,%.6f,%.0f,%.1f,%.1f\n", name, bench_ops, wall, ops_per_sec, percentile(50), percentile(99));
+  }
+  results++;
+}
+
+// ----------Benchmarks-------------------------------------------------------------------------------------------
+
+static void bench_find_free(const char *name, int full_bytes) {  // A map block with its first full_bytes bytes used
+  unsigned char block[BLOCK_SIZE];
+  memset(block, 0, BLOCK_SIZE);
+  memset(block, 0xff, full_bytes);
+  bench_start();
+  for (int s = 0; s < BENCH_SAMPLES; s++) {
+    unsigned long long start = simfs_stats_now();
+    for (int i = 0; i < BENCH_BATCH; i++) {
+      sink += find_free(block);
+    }
+    sample(start, BENCH_BATCH);
+  }
+  bench_finish(name);
+}
+
+static void bench_alloc(void) {  // alloc() until the block map is full
+  bench_start();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    mkfs(MAP_BITS);
+    for (;;) {
+      unsigned long long start = simfs_stats_now();
+      int block_num = alloc();
+      sample(start, 1);
+      if (block_num == -1) {
+        break;
+      }
+    }
+  }
+  bench_finish("alloc_burst");
+}
+
+static void bench_ialloc(void) {  // ialloc() until the inodes run out
+  bench_start();
+  for (int round = 0; round < BENCH_ROUNDS * 10; round++) {
+    mkfs(NUM_OF_BLOCKS);
+    for (;;) {
+      unsigned long long start = simfs_stats_now();
+      struct inode *in = ialloc();
+      sample(start, 1);
+      if (in == NULL) {
+        break;
+      }
+      iput(in);
+    }
+  }
+  bench_finish("ialloc_burst");
+}
+
+static void bench_iget(void) {  // iget()/iput() pairs over every inode
+  mkfs(NUM_OF_BLOCKS);
+  bench_start();
+  int inode_num = 0;
+  for (int s = 0; s < BENCH_SAMPLES; s++) {
+    unsigned long long start = simfs_stats_now();
+    for (int i = 0; i < BENCH_BATCH; i++) {
+      struct inode *in = iget(inode_num);
+      if (in != NULL) {
+        iput(in);
+      }
+      inode_num = (inode_num + 1) % MAX_INODES;
+    }
+    sample(start, BENCH_BATCH);
+  }
+  bench_finish("iget_iput_churn");
+}
+
+static void bench_directory_get(void) {  // Scans of a directory with an entry for every inode
+  char path[MAX_PATH_LENGTH];
+  mkfs(NUM_OF_BLOCKS);
+  for (int i = 1; i < MAX_INODES; i++) {
+    sprintf(path, "/d%d", i);
+    directory_make(path);
+  }
+  struct directory_entry ent;
+  bench_start();
+  for (int scan = 0; scan < BENCH_SCANS; scan++) {
+    struct directory *dir = directory_open(ROOT_INODE_NUM);
+    if (dir == NULL) {
+      break;
+    }
+    for (;;) {
+      unsigned long long start = simfs_stats_now();
+      int got = directory_get(dir, &ent);
+      sample(start, 1);
+      if (got == -1) {
+        break;
+      }
+    }
+    directory_close(dir);
+  }
+  bench_finish("directory_get_scan");
+}
+
+static void bench_mkfs(void) {
+  static const int sizes[] = { 64, NUM_OF_BLOCKS, 8192, MAP_BITS };
+  char name[32];
+  for (unsigned int i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+    bench_start();
+    for (int round = 0; round < BENCH_MKFS_ROUNDS; round++) {
+      unsigned long long start = simfs_stats_now();
+      sink += mkfs(sizes[i]);
+      sample(start, 1);
+    }
+    sprintf(name, "mkfs_%d", sizes[i]);
+    bench_finish(name);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "csv") != 0 && strcmp(argv[1], "json") != 0)) {
+    fprintf(stderr, "usage: %s [csv|json]\n", argv[0]);
+    return 1;
+  }
+  json = argc == 2 && strcmp(argv[1], "json") == 0;
+
+  bench_find_free("find_free_empty", 0);
+  bench_find_free("find_free_half", BLOCK_SIZE / 2);
+  bench_find_free("find_free_full", BLOCK_SIZE);
+
+  if (image_open(BENCH_IMAGE, 1) == -1) {
+    perror(BENCH_IMAGE);
+    return 1;
+  }
+  bench_alloc();
+  bench_ialloc();
+  bench_iget();
+  bench_directory_get();
+  bench_mkfs();
+  image_close();
+  unlink(BENCH_IMAGE);
+
+  if (json) {
+    printf(results? "\n]\n": "[]\n");
+  }
+  return 0;
+}
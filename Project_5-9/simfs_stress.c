@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "threadpool.h"
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "ctest.h"
+
+// Several threads building directories in one image at the same time, with
+// lookups and scans of each other's work mixed in. Run it under
+// -fsanitize=thread to check the locking as well as the results.
+
+#define STRESS_THREADS 8
+#define STRESS_OWN_DIRS 16     // Each thread's own subdirectories
+#define STRESS_SHARED_DIRS 8   // Each thread's entries in the one shared directory
+#define STRESS_CHURN 2000      // iget()/iput() rounds per thread on the root
+
+#ifdef CTEST_ENABLE
+struct worker {
+  int id;
+  int made;     // directory_make() calls that worked
+  int found;    // Lookups of our own directories that worked
+  int scanned;  // Entries seen by the scans of the shared directory
+};
+
+static void stress_worker(void *arg) {
+  struct worker *w = arg;
+  char path[MAX_PATH_LENGTH];
+
+  sprintf(path, "/t%d", w->id);
+  w->made += directory_make(path) == 0;
+  for (int i = 0; i < STRESS_OWN_DIRS; i++) {
+    sprintf(path, "/t%d/d%d", w->id, i);
+    w->made += directory_make(path) == 0;
+    sprintf(path, "/shared/t%d_%d", w->id, i);  // Everybody fights over this parent
+    if (i < STRESS_SHARED_DIRS) {
+      w->made += directory_make(path) == 0;
+    }
+
+    sprintf(path, "/t%d/d%d", w->id, i / 2);
+    struct inode *in = namei(path);
+    if (in != NULL) {
+      w->found++;
+      iput(in);
+    }
+
+    struct inode *shared = namei("/shared");  // And read it while the others write it
+    if (shared != NULL) {
+      struct directory *dir = directory_open(shared->inode_num);
+      struct directory_entry ent;
+      while (dir != NULL && directory_get(dir, &ent) != -1) {
+        w->scanned++;
+      }
+      if (dir != NULL) {
+        directory_close(dir);
+      }
+      iput(shared);
+    }
+  }
+
+  for (int i = 0; i < STRESS_CHURN; i++) {
+    struct inode *root = iget(ROOT_INODE_NUM);
+    if (root != NULL) {
+      iput(root);
+    }
+  }
+}
+
+void test_stress() {
+  image_open("stress_file.img", 1);
+  mkfs(NUM_OF_BLOCKS);
+  CTEST_ASSERT(directory_make("/shared") == 0, "Testing making the shared directory");
+
+  struct threadpool *pool = threadpool_create(STRESS_THREADS, 0);  // A worker apiece, so they all run at once
+  struct worker workers[STRESS_THREADS];
+  void *args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    workers[t] = (struct worker){ .id = t };
+    args[t] = &workers[t];
+  }
+  threadpool_submit_batch(pool, stress_worker, args, STRESS_THREADS);
+  threadpool_wait(pool);
+  threadpool_free(pool);
+  int made = 0, found = 0;
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    made += workers[t].made;
+    found += workers[t].found;
+  }
+  CTEST_ASSERT(made == STRESS_THREADS * (1 + STRESS_OWN_DIRS + STRESS_SHARED_DIRS), "Testing every directory_make() worked");
+  CTEST_ASSERT(found == STRESS_THREADS * STRESS_OWN_DIRS, "Testing every lookup of a finished directory worked");
+
+  int unique = 1;  // No two directories got the same inode
+  unsigned char seen[MAX_INODES] = {0};
+  struct inode *shared = namei("/shared");
+  struct directory *dir = directory_open(shared->inode_num);
+  iput(shared);
+  struct directory_entry ent;
+  int entries = 0;
+  while (directory_get(dir, &ent) != -1) {
+    if (ent.name[0] != '.') {
+      unique = unique && !seen[ent.inode_num];
+      seen[ent.inode_num] = 1;
+      entries++;
+    }
+  }
+  directory_close(dir);
+  CTEST_ASSERT(entries == STRESS_THREADS * STRESS_SHARED_DIRS, "Testing the shared directory has everybody's entries");
+
+  int resolved = 1;
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    for (int i = 0; i < STRESS_OWN_DIRS; i++) {
+      char path[MAX_PATH_LENGTH];
+      sprintf(path, "/t%d/d%d", t, i);
+      struct inode *in = namei(path);
+      resolved = resolved && in != NULL;
+      if (in != NULL) {
+        unique = unique && !seen[in->inode_num];
+        seen[in->inode_num] = 1;
+        iput(in);
+      }
+    }
+  }
+  CTEST_ASSERT(resolved, "Testing every path resolves afterwards");
+  CTEST_ASSERT(unique, "Testing no inode was handed out twice");
+  struct inode *root = iget(ROOT_INODE_NUM);
+  CTEST_ASSERT(root->ref_count == 1, "Testing the churn left the root's ref_count balanced");
+  iput(root);
+  image_close();
+
+  image_open("stress_file.img", 0);  // And it all made it to disk
+  struct inode *in = namei("/t3/d7");
+  CTEST_ASSERT(in != NULL, "Testing the directories survive a close");
+  if (in != NULL) {
+    iput(in);
+  }
+  image_close();
+}
+#endif
+
+int main(void) {
+  #ifdef CTEST_ENABLE
+  CTEST_VERBOSE(1);
+
+  test_stress();
+  CTEST_RESULTS();
+  CTEST_EXIT();
+  #endif
+}
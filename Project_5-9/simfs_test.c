@@ -1,16 +1,52 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "image.h"
 #include "block.h"
+#include "bcache.h"
 #include "free.h"
 #include "inode.h"
 #include "mkfs.h"
 #include "ls.h"
+#include "pack.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "aio.h"
+#include "journal.h"
+#include "stats.h"
 #include "ctest.h"
 
 #ifdef CTEST_ENABLE
+void test_pack_arrays() {
+  unsigned char raw[40];
+  unsigned short shorts[20];
+  unsigned int ints[10];
+  for (int i = 0; i < 40; i++) {
+    raw[i] = i;
+  }
+  read_u16_array(shorts, raw + 1, 19);  // Odd address and a tail past the vector loop
+  int ok = 1;
+  for (int i = 0; i < 19; i++) {
+    ok = ok && shorts[i] == read_u16(raw + 1 + i * 2);
+  }
+  CTEST_ASSERT(ok, "Testing read_u16_array() matches read_u16()");
+  read_u32_array(ints, raw, 10);
+  ok = 1;
+  for (int i = 0; i < 10; i++) {
+    ok = ok && ints[i] == read_u32(raw + i * 4);
+  }
+  CTEST_ASSERT(ok, "Testing read_u32_array() matches read_u32()");
+
+  unsigned char packed[40];
+  write_u16_array(packed, shorts, 19);
+  CTEST_ASSERT(memcmp(packed, raw + 1, 38) == 0, "Testing write_u16_array() undoes read_u16_array()");
+  write_u32_array(packed, ints, 10);
+  CTEST_ASSERT(memcmp(packed, raw, 40) == 0, "Testing write_u32_array() undoes read_u32_array()");
+}
+
 void test_image() {
   image_open("test_file.img", 0);
   image_close();
@@ -30,6 +66,78 @@ void test_blockb() {
   }
 }
 
+void test_bcache() {
+  unsigned char block[BLOCK_SIZE];
+  unsigned char block2[BLOCK_SIZE];
+  image_open("test_file.img", 1);
+  memset(block, 'c', BLOCK_SIZE);
+  bwrite(5, block);
+  CTEST_ASSERT(memcmp(bread(5, block2), block, BLOCK_SIZE) == 0, "Testing a cached write reads back");
+  for (int i = 0; i < BCACHE_BLOCKS * 2; i++) { // Push block 5 out of the cache
+    bread(100 + i, block2);
+  }
+  CTEST_ASSERT(memcmp(bread(5, block2), block, BLOCK_SIZE) == 0, "Testing an evicted dirty block was written back");
+  const unsigned char *pinned[BCACHE_BLOCKS];
+  for (int i = 0; i < BCACHE_BLOCKS; i++) { // Lend out every buffer
+    pinned[i] = bget(300 + i);
+  }
+  memset(block, 'e', BLOCK_SIZE);
+  bwrite(7, block);
+  for (int i = 0; i < BCACHE_BLOCKS; i++) {
+    brelse(pinned[i]);
+  }
+  image_read(7, 1, block2);
+  CTEST_ASSERT(memcmp(block2, block, BLOCK_SIZE) == 0, "Testing a write with every buffer pinned goes straight to the image");
+  memset(block, 'd', BLOCK_SIZE);
+  bwrite(6, block);
+  image_close();
+  image_open("test_file.img", 0);
+  CTEST_ASSERT(memcmp(bread(6, block2), block, BLOCK_SIZE) == 0, "Testing image_close() flushes the cache");
+  image_close();
+}
+
+void test_block_range() {
+  unsigned char blocks[BLOCK_SIZE * 4];
+  unsigned char blocks2[BLOCK_SIZE * 4];
+  unsigned char block[BLOCK_SIZE];
+  image_open("test_file.img", 1);
+  for (int i = 0; i < 4; i++) {
+    memset(blocks + i * BLOCK_SIZE, 'a' + i, BLOCK_SIZE);
+  }
+  CTEST_ASSERT(bwrite_range(20, 4, blocks) == 0, "Testing a multi-block write");
+  CTEST_ASSERT(memcmp(bread(22, block), blocks + 2 * BLOCK_SIZE, BLOCK_SIZE) == 0, "Testing a single block from a range write");
+  memset(block, 'z', BLOCK_SIZE);
+  bwrite(21, block); // Only in the cache so far
+  memcpy(blocks + BLOCK_SIZE, block, BLOCK_SIZE);
+  bread_range(20, 4, blocks2);
+  CTEST_ASSERT(memcmp(blocks, blocks2, BLOCK_SIZE * 4) == 0, "Testing a range read sees dirty cached blocks");
+  image_close();
+}
+
+void test_mmap() {
+  unsigned char block[BLOCK_SIZE];
+  unsigned char block2[BLOCK_SIZE];
+  CTEST_ASSERT(image_open_mmap("test_file.img", 1, 32, 1) != -1, "Testing opening a mapped image");
+  memset(block, 'm', BLOCK_SIZE);
+  bwrite(3, block);
+  const unsigned char *p = bget(3);
+  CTEST_ASSERT(p != NULL && memcmp(p, block, BLOCK_SIZE) == 0, "Testing a zero-copy read of a mapped block");
+  brelse(p);
+  CTEST_ASSERT(bget(32) == NULL, "Testing a zero-copy read past the mapping");
+  image_close();
+
+  image_open("test_file.img", 0);
+  CTEST_ASSERT(memcmp(bread(3, block2), block, BLOCK_SIZE) == 0, "Testing mapped writes reach the file");
+  p = bget(3);
+  CTEST_ASSERT(p != NULL && memcmp(p, block, BLOCK_SIZE) == 0, "Testing a zero-copy read through the cache");
+  for (int i = 0; i < BCACHE_BLOCKS * 2; i++) { // A borrowed buffer must survive cache pressure
+    bread(100 + i, block2);
+  }
+  CTEST_ASSERT(memcmp(p, block, BLOCK_SIZE) == 0, "Testing a borrowed block isn't evicted");
+  brelse(p);
+  image_close();
+}
+
 void test_free() {
   unsigned char block[BLOCK_SIZE];
   memset(block, 0xFF, BLOCK_SIZE);
@@ -39,21 +147,276 @@ void test_free() {
   CTEST_ASSERT(find_free(block) == 0, "testing find_free to 0 and set_free to 1");
 }
 
+void test_find_free_words() {
+  unsigned char block[BLOCK_SIZE];
+  int bits[] = {1, 7, 8, 63, 64, 255, 256, 1000, BLOCK_SIZE * BITS_PER_BYTE - 1};
+  for (unsigned int i = 0; i < sizeof bits / sizeof bits[0]; i++) {
+    memset(block, 0xFF, BLOCK_SIZE);
+    set_free(block, bits[i], 0);
+    set_free(block, BLOCK_SIZE * BITS_PER_BYTE - 1, 0); // A later clear bit mustn't win
+    CTEST_ASSERT(find_free(block) == bits[i], "testing find_free finds the lowest clear bit");
+  }
+  memset(block, 0xFF, BLOCK_SIZE);
+  CTEST_ASSERT(find_free(block) == -1, "testing find_free on a full map");
+  memset(block, 0, BLOCK_SIZE);
+  CTEST_ASSERT(find_free(block) == 0, "testing find_free on an empty map");
+  CTEST_ASSERT(find_low_clear_bit(0xF7) == 3, "testing find_low_clear_bit");
+  CTEST_ASSERT(find_low_clear_bit(0xFF) == -1, "testing find_low_clear_bit on a full byte");
+}
+
+void test_free_map() {
+  unsigned char block[BLOCK_SIZE];
+  struct free_map fm = { .block_num = FREE_DATA_BLOCK_NUM };
+  memset(block, 0, BLOCK_SIZE);
+  for (int i = 0; i < 3000; i++) {
+    free_map_set(&fm, block, free_map_find(&fm, block), 1);
+  }
+  CTEST_ASSERT(free_map_find(&fm, block) == 3000, "testing free_map_find walks up a filling map");
+  free_map_set(&fm, block, 70, 0);
+  free_map_set(&fm, block, 2000, 0);
+  CTEST_ASSERT(free_map_find(&fm, block) == find_free(block), "testing free_map_find matches find_free");
+  CTEST_ASSERT(free_map_find(&fm, block) == 70, "testing a freed bit below the hint is found");
+  memset(block, 0xFF, BLOCK_SIZE);
+  free_map_load(&fm, block);
+  CTEST_ASSERT(free_map_find(&fm, block) == -1, "testing free_map_find on a full map");
+
+  image_open("test_file.img", 1);
+  CTEST_ASSERT(alloc() == 0, "testing alloc() on an empty block map");
+  CTEST_ASSERT(alloc() == 1, "testing alloc() hands out the next block");
+  image_close();
+  image_open("test_file.img", 0);
+  CTEST_ASSERT(alloc() == 2, "testing alloc() picks up the map from a reopened image");
+  image_close();
+}
+
+void test_extent() {
+  int got;
+  image_open("test_file.img", 1);
+  CTEST_ASSERT(alloc() == 0, "testing alloc() before an extent");
+  CTEST_ASSERT(alloc_extent(100, &got) == 1 && got == 100, "testing alloc_extent() gets a full run");
+  CTEST_ASSERT(alloc() == 101, "testing alloc() after an extent");
+  free_extent(10, 20);
+  CTEST_ASSERT(alloc_extent(30, &got) == 102 && got == 30, "testing alloc_extent() skips a run that's too short");
+  CTEST_ASSERT(alloc_extent(20, &got) == 10 && got == 20, "testing alloc_extent() reuses a freed run");
+  CTEST_ASSERT(alloc_extent(MAP_BITS, &got) == 132 && got == MAP_BITS - 132, "testing alloc_extent() settles for the longest run");
+  CTEST_ASSERT(alloc_extent(1, &got) == -1 && got == 0, "testing alloc_extent() on a full map");
+  image_close();
+}
+
 void test_inode() {
   image_open("test_file.img", 0);
   CTEST_ASSERT(ialloc()->inode_num == 0, "Testing first with 0");
-  CTEST_ASSERT(alloc()->inode_num == 0, "Testing empty block map");
-  CTSET_ASSERT(ialloc()->inode_num == 1, "Testing second with 1");
-  CTEST_ASSERT(alloc()->inode_num == 0, "Testing non-empty block map");
+  CTEST_ASSERT(alloc() == 0, "Testing empty block map");
+  CTEST_ASSERT(ialloc()->inode_num == 1, "Testing second with 1");
+  CTEST_ASSERT(alloc() == 0, "Testing non-empty block map");
+  image_close();
+}
+
+void test_incore() {
+  struct inode *in[200];
+  image_open("test_file.img", 1);
+  for (int i = 0; i < 200; i++) {
+    in[i] = iget(i);
+  }
+  CTEST_ASSERT(in[199] != NULL && in[199]->inode_num == 199, "Testing more than one chunk of in-core inodes");
+  CTEST_ASSERT(find_incore(150) == in[150], "Testing find_incore() through the hash");
+  CTEST_ASSERT(iget(150) == in[150] && in[150]->ref_count == 2, "Testing iget() of an open inode");
+  iput(in[150]);
+  iput(in[150]);
+  CTEST_ASSERT(in[150]->ref_count == 0, "Testing iput() drops ref_count");
+  CTEST_ASSERT(iget(150) == in[150] && in[150]->ref_count == 1, "Testing iget() revives a cached inode");
+  struct inode *f = find_incore_free();
+  CTEST_ASSERT(f != NULL && f->ref_count == 0, "Testing find_incore_free() finds an unused slot");
+  CTEST_ASSERT(find_incore_free() == f, "Testing find_incore_free() leaves it on the free list");
+  for (int i = 0; i < 200; i++) {
+    iput(in[i]);
+  }
+  image_close();
+}
+
+void test_inode_block() {
+  image_open("test_file.img", 1);
+  for (int i = 60; i < 70; i++) { // Spans two inode blocks
+    struct inode *in = iget(i);
+    in->size = i * 100;
+    in->owner_id = i;
+    in->flags = 1;
+    in->block_ptr[INODE_PTR_COUNT - 1] = i + 1000;
+    write_inode(in);
+    iput(in);
+  }
+  image_close();
+
+  image_open("test_file.img", 0);
+  struct inode *in = iget(65);
+  CTEST_ASSERT(in->size == 6500 && in->owner_id == 65 && in->flags == 1, "Testing inode fields survive a close");
+  CTEST_ASSERT(in->block_ptr[INODE_PTR_COUNT - 1] == 1065, "Testing block pointers survive a close");
+  unsigned char block[BLOCK_SIZE];
+  bread(get_block_num(63), block);
+  CTEST_ASSERT(read_u32(block + get_block_offset_bytes(get_block_offset(63))) == 6300, "Testing the inode block was encoded on disk");
+  iput(in);
+  image_close();
+}
+
+void test_isync() {
+  unsigned char block[BLOCK_SIZE];
+  int offset = get_block_offset_bytes(get_block_offset(5));
+  image_open("test_file.img", 1);
+  struct inode *in = iget(5);
+  in->size = 12345;
+  iput(in);
+  in = iget(5);
+  in->owner_id = 77;
+  iput(in);
+  bread(get_block_num(5), block);
+  CTEST_ASSERT(read_u32(block + offset) == 0, "Testing iput() defers the write");
+  isync();
+  bread(get_block_num(5), block);
+  CTEST_ASSERT(read_u32(block + offset) == 12345 && read_u16(block + offset + 4) == 77, "Testing isync() writes both changes");
+  offset = get_block_offset_bytes(get_block_offset(10));
+  for (int i = 10; i < 10 + ISYNC_THRESHOLD; i++) {
+    if (i == 10 + ISYNC_THRESHOLD - 1) {
+      bread(get_block_num(10), block);
+      CTEST_ASSERT(read_u32(block + offset) == 0, "Testing iput() defers writes below ISYNC_THRESHOLD");
+    }
+    in = iget(i);
+    in->size = i;
+    iput(in);
+  }
+  bread(get_block_num(10), block);
+  CTEST_ASSERT(read_u32(block + offset) == 10, "Testing iput() calls isync() at ISYNC_THRESHOLD");
+  struct inode *al = ialloc();
+  CTEST_ASSERT(al != NULL && al->inode_num == 0, "Testing ialloc() on an empty inode map");
+  al->size = 999;
+  iput(al);
+  image_close();
+
+  image_open("test_file.img", 0);
+  in = iget(0);
+  CTEST_ASSERT(in->size == 999, "Testing image_close() writes back a deferred inode");
+  iput(in);
   image_close();
 }
 
+void make_test_root() { // A fresh image with just a root directory
+  image_open("test_file.img", 1);
+  mkfs(NUM_OF_BLOCKS);
+}
+
+void test_namei() {
+  make_test_root();
+  struct inode *in = namei("/");
+  CTEST_ASSERT(in != NULL && in->inode_num == ROOT_INODE_NUM, "Testing namei() of /");
+  iput(in);
+  CTEST_ASSERT(namei("/foo") == NULL, "Testing namei() of a missing name");
+  CTEST_ASSERT(directory_make("/foo") == 0, "Testing directory_make() in the root");
+  CTEST_ASSERT(directory_make("/foo") == -1, "Testing directory_make() of an existing name");
+  in = namei("/foo");
+  CTEST_ASSERT(in != NULL && in->inode_num == 1 && in->flags == DIRECTORY_FLAG, "Testing namei() after directory_make() replaced a negative entry");
+  iput(in);
+  CTEST_ASSERT(directory_make("/foo/bar") == 0, "Testing directory_make() in a subdirectory");
+  CTEST_ASSERT(directory_make("/foo/bar/baz") == 0, "Testing directory_make() two levels down");
+  in = namei("/foo/bar/baz");
+  CTEST_ASSERT(in != NULL && in->inode_num == 3, "Testing a three component namei()");
+  iput(in);
+  in = namei("/foo/bar/..");
+  CTEST_ASSERT(in != NULL && in->inode_num == 1, "Testing namei() through ..");
+  iput(in);
+  CTEST_ASSERT(namei("/foo/nope/baz") == NULL, "Testing namei() with a missing middle component");
+  int cached;
+  CTEST_ASSERT(dcache_lookup(1, "nope", &cached) && cached == DCACHE_NEGATIVE, "Testing a missing name goes in the dcache");
+  CTEST_ASSERT(!dcache_lookup(1, "..", &cached), "Testing the entries a lookup passes don't");
+  CTEST_ASSERT(namei("foo") == NULL, "Testing namei() of a relative path");
+  int last = -1;
+  for (int b; (b = alloc()) != -1; last = b) { // Fill the block map
+  }
+  CTEST_ASSERT(directory_make("/full") == -1, "Testing directory_make() with no free blocks");
+  free_extent(last, 1);
+  CTEST_ASSERT(directory_make("/full") == 0, "Testing directory_make() once there's a block again");
+  in = namei("/full");
+  CTEST_ASSERT(in != NULL && in->inode_num == 4, "Testing the failed directory_make() gave its inode back");
+  iput(in);
+  image_close();
+
+  image_open("test_file.img", 0);
+  in = namei("/foo/bar/baz");
+  CTEST_ASSERT(in != NULL && in->inode_num == 3, "Testing namei() from disk after a reopen");
+  iput(in);
+  image_close();
+}
+
+void test_directory_get() {
+  char path[MAX_PATH_LENGTH];
+  struct directory_entry ents[50];
+  struct directory_entry ent;
+  make_test_root();
+  for (int i = 0; i < 200; i++) { // 202 entries with . and .., so two blocks
+    sprintf(path, "/d%d", i);
+    directory_make(path);
+  }
+  struct directory *dir = directory_open(ROOT_INODE_NUM);
+  int total = 0, n, names_ok = 1;
+  while ((n = directory_get_many(dir, ents, 50)) > 0) {
+    for (int i = 0; i < n; i++, total++) {
+      if (total >= 2) {
+        sprintf(path, "d%d", total - 2);
+        names_ok = names_ok && strcmp(ents[i].name, path) == 0 && ents[i].inode_num == (unsigned int)total - 1;
+      }
+    }
+  }
+  CTEST_ASSERT(total == 202, "Testing directory_get_many() across blocks");
+  CTEST_ASSERT(names_ok, "Testing directory_get_many() entries");
+  directory_close(dir);
+
+  dir = directory_open(ROOT_INODE_NUM);
+  for (int i = 0; i < 130; i++) {
+    directory_get(dir, &ent);
+  }
+  CTEST_ASSERT(strcmp(ent.name, "d127") == 0, "Testing directory_get() into the second block");
+  CTEST_ASSERT(directory_get_many(dir, ents, 50) == 50 && strcmp(ents[0].name, "d128") == 0, "Testing mixing directory_get() and directory_get_many()");
+  directory_close(dir);
+  image_close();
+}
+
+void test_directory_index() {
+  char path[MAX_PATH_LENGTH];
+  directory_index_threshold = 100;
+  make_test_root();
+  for (int i = 0; i < 200; i++) {
+    sprintf(path, "/d%d", i);
+    directory_make(path);
+  }
+  struct inode *root = iget(ROOT_INODE_NUM);
+  CTEST_ASSERT(root->index_block != 0, "Testing a big directory gets an index");
+  CTEST_ASSERT(directory_index_mask(root, "d150") & (1u << 1), "Testing the index points at the right block");
+  iput(root);
+  struct inode *small = namei("/d0");
+  CTEST_ASSERT(small->index_block == 0, "Testing a small directory has no index");
+  iput(small);
+  image_close();
+
+  image_open("test_file.img", 0); // Nothing in the dentry cache now
+  int all_found = 1;
+  for (int i = 0; i < 200; i++) {
+    sprintf(path, "/d%d", i);
+    struct inode *in = namei(path);
+    all_found = all_found && in != NULL && in->inode_num == (unsigned int)i + 1;
+    if (in != NULL) {
+      iput(in);
+    }
+  }
+  CTEST_ASSERT(all_found, "Testing namei() through the index");
+  CTEST_ASSERT(namei("/nope") == NULL, "Testing namei() of a missing name with an index");
+  image_close();
+  directory_index_threshold = DIRECTORY_INDEX_THRESHOLD;
+}
+
 void test_mkfs() {
   image_open("test_file.img", 0);
   unsigned char block[BLOCK_SIZE];
   unsigned char block2[BLOCK_SIZE];
   memset(block, 'h', BLOCK_SIZE);
-  mkfs();
+  mkfs(NUM_OF_BLOCKS);
 
   CTEST_ASSERT(memcmp(bread(BITS_PER_BYTE, block2), block, 4) == 0, "Testing i all blocks are 0");
   CTEST_ASSERT(alloc() == 7, "Testing if blocks are allocated correctly");
@@ -61,19 +424,232 @@ void test_mkfs() {
   image_close();
 }
 
+void test_bmap() {
+  image_open("test_file.img", 1);
+  mkfs(NUM_OF_BLOCKS);
+  struct inode *in = ialloc();
+  int inode_num = in->inode_num;
+  CTEST_ASSERT(bmap(in, 0, 0) == 0, "Testing bmap() of a hole");
+  CTEST_ASSERT(bmap(in, 0, 1) == MKFS_BLOCKS, "Testing bmap() allocating a direct block");
+  CTEST_ASSERT(bmap(in, INODE_PTR_COUNT, 1) == MKFS_BLOCKS + 2 && in->indirect == MKFS_BLOCKS + 1, "Testing bmap() through the indirect block");
+  CTEST_ASSERT(bmap(in, INODE_PTR_COUNT + 1, 0) == 0, "Testing bmap() of a hole in the indirect block");
+  int far = INODE_PTR_COUNT + PTRS_PER_BLOCK + PTRS_PER_BLOCK + 5;
+  CTEST_ASSERT(bmap(in, far, 1) == MKFS_BLOCKS + 5 && in->double_indirect == MKFS_BLOCKS + 3, "Testing bmap() through the double indirect block");
+  CTEST_ASSERT(bmap(in, far - 1, 0) == 0, "Testing bmap() of a hole in the double indirect block");
+  CTEST_ASSERT(bmap(in, MAX_FILE_BLOCKS, 1) == -1 && bmap(in, -1, 0) == -1, "Testing bmap() out of range");
+  iput(in);
+  image_close();
+
+  image_open("test_file.img", 0);
+  in = iget(inode_num);
+  CTEST_ASSERT(bmap(in, INODE_PTR_COUNT, 0) == MKFS_BLOCKS + 2, "Testing the indirect block survives a close");
+  CTEST_ASSERT(bmap(in, far, 0) == MKFS_BLOCKS + 5, "Testing the double indirect block survives a close");
+  iput(in);
+  image_close();
+}
+
+static void count_read(int block_num, unsigned char *buf, int result, void *arg) {
+  int *good = arg;
+  *good += result == 0 && buf[0] == block_num && buf[BLOCK_SIZE - 1] == block_num;
+}
+
+static void *aio_reads(void *unused) {  // Queue 20 reads and wait for them; returns how many came back right
+  static int good;
+  static unsigned char bufs[20][BLOCK_SIZE];
+  (void)unused;
+  good = 0;
+  for (int i = 0; i < 20; i++) {
+    bread_async(20 + i, bufs[i], count_read, &good);
+  }
+  bsubmit();
+  return bwait() == 0? &good: NULL;
+}
+
+void test_aio() {
+  unsigned char blocks[30][BLOCK_SIZE];
+  image_open("test_file.img", 1);
+  for (int i = 0; i < 30; i++) {
+    memset(blocks[i], 20 + i, BLOCK_SIZE);
+  }
+  bwrite_range(20, 30, blocks[0]);
+  memset(blocks[0], 25, BLOCK_SIZE);
+  bwrite(25, blocks[0]);  // Only in the cache so far; it's the same data, but the read has to find it there
+
+  int *good = aio_reads(NULL);
+  CTEST_ASSERT(good != NULL && *good == 20, "Testing bread_async() reads");
+
+  pthread_t thread;
+  aio_use_uring = 0;  // Same again on a thread that has to use the pool
+  pthread_create(&thread, NULL, aio_reads, NULL);
+  pthread_join(thread, (void **)&good);
+  aio_use_uring = 1;
+  CTEST_ASSERT(good != NULL && *good == 20, "Testing bread_async() through the thread pool");
+
+  CTEST_ASSERT(bwait() == 0, "Testing bwait() with nothing queued");
+  breadahead(45);
+  bcache_lock();
+  CTEST_ASSERT(bcache_peek(45) == NULL, "Testing readahead isn't cached before bwait()");
+  bcache_unlock();
+  bwait();
+  bcache_lock();
+  struct buf *b = bcache_peek(45);
+  CTEST_ASSERT(b != NULL && b->data[0] == 45 && !b->dirty, "Testing readahead lands in the cache");
+  bcache_unlock();
+
+  breadahead(46);  // A write while the read is out wins
+  memset(blocks[0], 99, BLOCK_SIZE);
+  bwrite(46, blocks[0]);
+  bcache_reset();  // Drop the write's buffer (without writing it) so only the readahead could fill it
+  bwait();
+  bcache_lock();
+  CTEST_ASSERT(bcache_peek(46) == NULL, "Testing readahead doesn't undo a newer write");
+  bcache_unlock();
+  image_close();
+}
+
+static void copy_file(char *from, char *to) {  // A snapshot of what's on disk, as a crash would leave it
+  unsigned char buf[BLOCK_SIZE];
+  int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ssize_t n;
+  while ((n = read(in, buf, sizeof buf)) > 0) {
+    write(out, buf, n);
+  }
+  close(in);
+  close(out);
+}
+
+void test_journal() {
+  image_open("test_file.img", 1);
+  mkfs(NUM_OF_BLOCKS);
+  CTEST_ASSERT(!journal_active(), "Testing no journal before journal_open()");
+  CTEST_ASSERT(journal_open("test_file.jnl") == 0 && journal_active(), "Testing journal_open()");
+  unsigned int commits = journal_commits;
+  CTEST_ASSERT(directory_make("/a") == 0 && directory_make("/a/b") == 0, "Testing directory_make() with a journal");
+  struct inode *in = namei("/a/b");
+  CTEST_ASSERT(in != NULL, "Testing journaled changes read back before they're checkpointed");
+  iput(in);
+  CTEST_ASSERT(journal_sync() == 0 && journal_commits > commits, "Testing journal_sync() commits");
+  commits = journal_commits;
+  CTEST_ASSERT(journal_sync() == 0 && journal_commits == commits, "Testing journal_sync() with nothing new");
+  copy_file("test_file.img", "test_crash.img");  // As if we crashed here, before a checkpoint
+  copy_file("test_file.jnl", "test_crash.jnl");
+  image_close();
+
+  image_open("test_crash.img", 0);
+  in = namei("/a/b");
+  CTEST_ASSERT(in == NULL, "Testing the image alone doesn't have the changes yet");
+  CTEST_ASSERT(journal_open("test_crash.jnl") == 0, "Testing journal_open() after a crash");
+  in = namei("/a/b");
+  CTEST_ASSERT(in != NULL, "Testing recovery replays committed transactions");
+  if (in != NULL) {
+    iput(in);
+  }
+  image_close();
+
+  image_open("test_file.img", 0);
+  in = namei("/a/b");
+  CTEST_ASSERT(in != NULL, "Testing image_close() checkpoints the journal");
+  if (in != NULL) {
+    iput(in);
+  }
+  image_close();
+  unlink("test_crash.img");
+  unlink("test_crash.jnl");
+  unlink("test_file.jnl");
+}
+
+void test_stats() {
+  simfs_stats_reset();
+  for (int i = 1; i <= 100; i++) {
+    simfs_stats_record(HIST_FIND_FREE_SCAN, i);
+  }
+  CTEST_ASSERT(simfs_histograms[HIST_FIND_FREE_SCAN].count == 100 && simfs_histograms[HIST_FIND_FREE_SCAN].max == 100, "Testing simfs_stats_record()");
+  CTEST_ASSERT(simfs_stats_percentile(HIST_FIND_FREE_SCAN, 50) == 63, "Testing the median is the top of its bucket");
+  CTEST_ASSERT(simfs_stats_percentile(HIST_FIND_FREE_SCAN, 99) == 100, "Testing a percentile is never past the max");
+  CTEST_ASSERT(simfs_stats_percentile(HIST_BREAD, 50) == 0, "Testing a percentile with no samples");
+
+#ifdef SIMFS_STATS_ENABLE
+  unsigned char block[BLOCK_SIZE] = {0};
+  simfs_stats_reset();
+  image_open("test_file.img", 1);
+  bwrite(3, block);
+  bread(3, block);
+  bread(3, block);
+  CTEST_ASSERT(simfs_counters[STAT_BREAD] == 2 && simfs_counters[STAT_BWRITE] == 1, "Testing bread()/bwrite() are counted");
+  CTEST_ASSERT(simfs_counters[STAT_BYTES_READ] == 2 * BLOCK_SIZE, "Testing bytes read are counted");
+  CTEST_ASSERT(simfs_counters[STAT_CACHE_MISS] == 1 && simfs_counters[STAT_CACHE_HIT] == 2, "Testing cache hits and misses");
+  CTEST_ASSERT(simfs_histograms[HIST_BREAD].count == 2, "Testing bread() is timed");
+  struct free_map fm;
+  memset(block, 0, BLOCK_SIZE);
+  memset(block, 0xff, 200 * BITS_PER_WORD / BITS_PER_BYTE); // 200 full map words
+  free_map_load(&fm, block);
+  simfs_stats_reset();
+  find_free(block);
+  free_map_find(&fm, block);
+  CTEST_ASSERT(simfs_histograms[HIST_FIND_FREE_SCAN].count == 2 && simfs_histograms[HIST_FIND_FREE_SCAN].sum == 201 + 1, "Testing find_free() and free_map_find() both count map words");
+  image_close();
+#endif
+  simfs_stats_reset();
+}
+
+void test_fast_mkfs() {
+  struct directory_entry ents[4];
+  image_open("test_file.img", 1);
+  CTEST_ASSERT(mkfs(RESERVED_BLOCKS) == -1, "Testing mkfs() with no room for the root directory");
+  CTEST_ASSERT(mkfs(NUM_OF_BLOCKS) == 0, "Testing mkfs()");
+  CTEST_ASSERT(lseek(image_fd, 0, SEEK_END) == NUM_OF_BLOCKS * BLOCK_SIZE, "Testing mkfs() sizes the image");
+  CTEST_ASSERT(alloc() == MKFS_BLOCKS, "Testing the first free block after mkfs()");
+  struct inode *in = ialloc();
+  CTEST_ASSERT(in != NULL && in->inode_num == ROOT_INODE_NUM + 1, "Testing the first free inode after mkfs()");
+  iput(in);
+  struct directory *dir = directory_open(ROOT_INODE_NUM);
+  CTEST_ASSERT(directory_get_many(dir, ents, 4) == 2, "Testing the root directory has two entries");
+  CTEST_ASSERT(strcmp(ents[0].name, ".") == 0 && strcmp(ents[1].name, "..") == 0, "Testing the root directory's . and ..");
+  CTEST_ASSERT(ents[1].inode_num == ROOT_INODE_NUM, "Testing the root's .. is the root");
+  directory_close(dir);
+
+  int got;
+  CTEST_ASSERT(mkfs(64) == 0, "Testing mkfs() of a smaller image");
+  CTEST_ASSERT(alloc_extent(1000, &got) == MKFS_BLOCKS && got == 64 - MKFS_BLOCKS, "Testing blocks past the end of the image aren't free");
+  image_close();
+
+  image_open_mmap("test_file.img", 1, 16, 0);
+  CTEST_ASSERT(mkfs(128) == 0, "Testing mkfs() of a mapped image");
+  CTEST_ASSERT(directory_make("/foo") == 0 && alloc() == MKFS_BLOCKS + 1, "Testing a mapped image after mkfs()");
+  image_close();
+}
+
 #endif
 
 int main(void) {
   #ifdef CTEST_ENABLE
   CTEST_VERBOSE(1);
 
+  test_pack_arrays();
   test_image();
   test_blockb();
+  test_bcache();
+  test_block_range();
+  test_mmap();
   test_free();
+  test_find_free_words();
+  test_free_map();
+  test_extent();
   test_inode();
+  test_incore();
+  test_inode_block();
+  test_isync();
+  test_namei();
+  test_directory_get();
+  test_directory_index();
   test_mkfs();
+  test_fast_mkfs();
+  test_bmap();
+  test_aio();
+  test_journal();
+  test_stats();
   ls();
   CTEST_RESULTS();
-  CTSET_EXIT();
+  CTEST_EXIT();
   #endif
 }
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+// ----------Performance Counters-------------------------------------------------------------------------------------------
+
+  // Every counter and histogram is updated with relaxed atomics, so any
+  // thread can bump them without a lock. A dump taken while others are
+  // still running is a little fuzzy, but never wrong by more than the
+  // operations in flight.
+
+  // Histograms are powers of two: a value v goes in bucket b when
+  // 2^(b-1) <= v < 2^b (and 0 goes in bucket 0). That's coarse, but
+  // recording is a count-leading-zeros and an add, and a percentile is
+  // good to within a factor of two, which is plenty to size a cache or see
+  // whether a change helped.
+
+unsigned long long simfs_counters[STAT_COUNTERS];
+struct stat_histogram_data simfs_histograms[STAT_HISTOGRAMS];
+
+#ifdef SIMFS_STATS_ENABLE
+static const char *counter_names[STAT_COUNTERS] = {
+  "bread", "bwrite", "bytes_read", "bytes_written", "cache_hit", "cache_miss",
+  "image_reads", "image_writes", "iget_hit", "iget_read", "find_free", "directory_get",
+};
+
+static const char *histogram_names[STAT_HISTOGRAMS] = {
+  "bread_ns", "bwrite_ns", "iget_ns", "alloc_ns", "ialloc_ns", "namei_ns",
+  "directory_get_ns", "directory_make_ns", "find_free_scan_words",
+};
+#endif
+
+unsigned long long simfs_stats_now(void) {  // Nanoseconds on a clock that only goes forward
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void simfs_stats_record(enum stat_histogram hist, unsigned long long value) {
+  struct stat_histogram_data *h = &simfs_histograms[hist];
+  int bucket = value == 0? 0: 64 - __builtin_clzll(value);
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+  __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void simfs_stats_stop(struct stat_timer *timer) {  // STAT_TIME()'s cleanup, when its block ends
+  simfs_stats_record(timer->hist, simfs_stats_now() - timer->start);
+}
+
+// The value pct percent of the samples are at or below, as the top of the
+// bucket it lands in. 0 if there aren't any samples.
+unsigned long long simfs_stats_percentile(enum stat_histogram hist, double pct) {
+  struct stat_histogram_data *h = &simfs_histograms[hist];
+  unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+  if (count == 0) {
+    return 0;
+  }
+  unsigned long long want = (unsigned long long)(count * pct / 100.0 + 0.5);
+  if (want == 0) {
+    want = 1;
+  }
+  unsigned long long seen = 0;
+  for (int b = 0; b < STATS_BUCKETS; b++) {
+    seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    if (seen >= want) {
+      unsigned long long top = b == 0? 0: (1ULL << (b - 1)) * 2 - 1;
+      unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+      return top < max? top: max;
+    }
+  }
+  return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+// One "name value" line per counter, then one line per histogram that has
+// samples, so it's easy to read and easy to grep.
+void simfs_stats_dump(FILE *out) {
+#ifndef SIMFS_STATS_ENABLE
+  fprintf(out, "simfs stats: not compiled in (build with make STATS=1)\n");
+#else
+  fprintf(out, "simfs stats:\n");
+  for (int c = 0; c < STAT_COUNTERS; c++) {
+    fprintf(out, "  %-20s %llu\n", counter_names[c], __atomic_load_n(&simfs_counters[c], __ATOMIC_RELAXED));
+  }
+  unsigned long long hits = simfs_counters[STAT_CACHE_HIT], misses = simfs_counters[STAT_CACHE_MISS];
+  if (hits + misses > 0) {
+    fprintf(out, "  %-20s %.1f%%\n", "cache_hit_rate", 100.0 * hits / (hits + misses));
+  }
+  for (int h = 0; h < STAT_HISTOGRAMS; h++) {
+    struct stat_histogram_data *d = &simfs_histograms[h];
+    unsigned long long count = __atomic_load_n(&d->count, __ATOMIC_RELAXED);
+    if (count == 0) {
+      continue;
+    }
+    fprintf(out, "  %-20s count %llu mean %llu p50 %llu p90 %llu p99 %llu max %llu\n", histogram_names[h], count,
+      __atomic_load_n(&d->sum, __ATOMIC_RELAXED) / count, simfs_stats_percentile(h, 50),
+      simfs_stats_percentile(h, 90), simfs_stats_percentile(h, 99), __atomic_load_n(&d->max, __ATOMIC_RELAXED));
+  }
+#endif
+}
+
+void simfs_stats_report(void) {  // Called from image_close(); dumps to stderr if SIMFS_STATS is set (and not "0")
+  const char *env = getenv("SIMFS_STATS");
+  if (env != NULL && env[0] != '\0' && strcmp(env, "0") != 0) {
+    simfs_stats_dump(stderr);
+  }
+}
+
+void simfs_stats_reset(void) {  // Start counting from zero, say between benchmark runs
+  for (int c = 0; c < STAT_COUNTERS; c++) {
+    __atomic_store_n(&simfs_counters[c], 0, __ATOMIC_RELAXED);
+  }
+  memset(simfs_histograms, 0, sizeof simfs_histograms);
+}
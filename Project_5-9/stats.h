@@ -0,0 +1,77 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#define STATS_BUCKETS 64  // Histogram bucket b holds values in [2^(b-1), 2^b)
+
+enum stat_counter {
+  STAT_BREAD,          // bread() calls
+  STAT_BWRITE,         // bwrite() calls
+  STAT_BYTES_READ,     // Bytes through bread() and bread_range()
+  STAT_BYTES_WRITTEN,  // Bytes through bwrite() and bwrite_range()
+  STAT_CACHE_HIT,      // bcache_get() found the block
+  STAT_CACHE_MISS,     // bcache_get() had to take a buffer for it
+  STAT_IMAGE_READS,    // image_read() calls, each one pread() loop
+  STAT_IMAGE_WRITES,   // image_write() calls
+  STAT_IGET_HIT,       // iget() found the inode in core
+  STAT_IGET_READ,      // iget() read the inode from disk
+  STAT_FIND_FREE,      // Free map searches
+  STAT_DIRECTORY_GET,  // directory_get() calls
+  STAT_COUNTERS
+};
+
+enum stat_histogram {
+  HIST_BREAD,           // Latencies, in nanoseconds
+  HIST_BWRITE,
+  HIST_IGET,
+  HIST_ALLOC,
+  HIST_IALLOC,
+  HIST_NAMEI,
+  HIST_DIRECTORY_GET,
+  HIST_DIRECTORY_MAKE,
+  HIST_FIND_FREE_SCAN,  // Map words looked at per free map search
+  STAT_HISTOGRAMS
+};
+
+struct stat_histogram_data {
+  unsigned long long count, sum, max;
+  unsigned long long buckets[STATS_BUCKETS];
+};
+
+struct stat_timer {
+  enum stat_histogram hist;
+  unsigned long long start;
+};
+
+  // Build with -DSIMFS_STATS_ENABLE (make STATS=1) to turn these on. Without
+  // it the macros below are empty and nothing is counted or timed.
+
+  // STAT_TIME(h) at the top of a block times the rest of it, however the
+  // block is left, into histogram h. Only one per block.
+
+#ifdef SIMFS_STATS_ENABLE
+#define STAT_COUNT(counter, n) __atomic_fetch_add(&simfs_counters[counter], (n), __ATOMIC_RELAXED)
+#define STAT_RECORD(hist, value) simfs_stats_record((hist), (value))
+#define STAT_TIME(hist) \
+  struct stat_timer stat_timer_ __attribute__((cleanup(simfs_stats_stop), unused)) = { (hist), simfs_stats_now() }
+#define STAT_REPORT() simfs_stats_report()
+#else
+#define STAT_COUNT(counter, n) ((void)0)
+#define STAT_RECORD(hist, value) ((void)0)
+#define STAT_TIME(hist) ((void)0)
+#define STAT_REPORT() ((void)0)
+#endif
+
+extern unsigned long long simfs_counters[STAT_COUNTERS];
+extern struct stat_histogram_data simfs_histograms[STAT_HISTOGRAMS];
+
+unsigned long long simfs_stats_now(void);
+void simfs_stats_record(enum stat_histogram hist, unsigned long long value);
+void simfs_stats_stop(struct stat_timer *timer);
+unsigned long long simfs_stats_percentile(enum stat_histogram hist, double pct);
+void simfs_stats_dump(FILE *out);
+void simfs_stats_report(void);
+void simfs_stats_reset(void);
+
+#endif
@@ -0,0 +1,560 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+#define THREADPOOL_CACHE_LINE 64
+#define THREADPOOL_DEQUE_SIZE 64  // Starting slots per deque; it doubles when it fills
+#define THREADPOOL_CHUNKS 4       // parallel_for chunks per worker when it picks the grain
+#define THREADPOOL_STEAL_TRIES 4  // Rounds of stealing before a worker believes everyone's empty
+
+struct tp_task {
+    void (*fn)(void *);
+    void *arg;
+};
+
+struct tp_array {
+    long size;                 // A power of two
+    struct tp_array *retired;  // The smaller one this replaced; a thief may still be reading it
+    struct tp_task tasks[];
+};
+
+struct tp_worker {
+    long top __attribute__((aligned(THREADPOOL_CACHE_LINE)));     // Thieves take from here
+    long bottom __attribute__((aligned(THREADPOOL_CACHE_LINE)));  // The owner pushes and takes here
+    struct tp_array *array;
+    struct threadpool *pool;
+    int id;
+    unsigned long long rng;  // For picking victims
+    pthread_t thread;
+} __attribute__((aligned(THREADPOOL_CACHE_LINE)));
+
+struct threadpool {
+    int size, flags;
+    struct tp_worker *workers;
+
+    pthread_mutex_t lock;   // Covers the shared queue, sleeping, and stopping
+    pthread_cond_t wake;    // Idle workers sleep here
+    pthread_cond_t idle;    // threadpool_wait() sleeps here
+    int sleeping;           // Workers waiting on wake
+    int stopping;
+    long queued;            // Tasks submitted and not yet picked up
+    long pending;           // Tasks submitted and not yet finished
+
+    struct tp_task *shared;  // Tasks from outside the pool: a ring of shared_size
+    long shared_head, shared_count, shared_size;
+};
+
+static __thread struct tp_worker *self;  // The worker this thread is, if it is one
+static __thread unsigned long long outsider_rng = 0x9E3779B97F4A7C15ULL;
+
+struct tp_loop {
+    void (*fn)(long, long, void *);
+    void *arg;
+    long remaining;  // Chunks not yet finished
+};
+
+struct tp_chunk {
+    struct tp_loop *loop;
+    long lo, hi;
+};
+
+// ------------------- Deques -------------------
+
+// Chase and Lev's deque, as Le et al. wrote it for C11, except that the
+// fences are folded into sequentially consistent loads and stores. Only
+// the owner touches bottom and array, except that thieves read them; top
+// only ever goes up, by compare-and-swap. The owner and a thief only
+// race over the last task, and the swap of top settles it.
+
+// Tasks are two words, so each field is read and written on its own. A
+// thief's reads can only be of a slot the owner won't write again until
+// top has moved past it, so if the thief wins the swap they're good.
+
+static void load_task(struct tp_array *a, long i, struct tp_task *task)
+{
+    struct tp_task *slot = &a->tasks[i & (a->size - 1)];
+
+    task->fn = __atomic_load_n(&slot->fn, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+}
+
+static struct tp_array *deque_grow(struct tp_worker *w, struct tp_array *a, long top, long bottom)
+{
+    struct tp_array *bigger = malloc(sizeof *bigger + 2 * a->size * sizeof bigger->tasks[0]);
+
+    if (bigger == NULL) return NULL;
+
+    bigger->size = 2 * a->size;
+    bigger->retired = a;
+
+    for (long i = top; i < bottom; i++) {
+        struct tp_task task;
+
+        load_task(a, i, &task);
+        bigger->tasks[i & (bigger->size - 1)] = task;
+    }
+
+    __atomic_store_n(&w->array, bigger, __ATOMIC_RELEASE);
+
+    return bigger;
+}
+
+static int deque_push(struct tp_worker *w, void (*fn)(void *), void **args, int n)  // Owner only
+{
+    long bottom = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    struct tp_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+
+    while (bottom + n - top > a->size) {
+        if ((a = deque_grow(w, a, top, bottom)) == NULL) return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct tp_task *slot = &a->tasks[(bottom + i) & (a->size - 1)];
+
+        __atomic_store_n(&slot->fn, fn, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->arg, args[i], __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&w->bottom, bottom + n, __ATOMIC_RELEASE);  // All n at once
+
+    return 0;
+}
+
+static int deque_take(struct tp_worker *w, struct tp_task *task)  // Owner only; the newest task
+{
+    long bottom = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    struct tp_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&w->bottom, bottom, __ATOMIC_SEQ_CST);
+
+    long top = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+
+    if (top > bottom) {  // Empty
+        __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    load_task(a, bottom, task);
+
+    if (top < bottom) return 1;  // More than one, so no thief can be after this one
+
+    int won = __atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+    return won;
+}
+
+static int deque_steal(struct tp_worker *w, struct tp_task *task)  // Anybody; the oldest task
+{
+    long top = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+
+    if (top >= bottom) return 0;  // Empty
+
+    load_task(__atomic_load_n(&w->array, __ATOMIC_ACQUIRE), top, task);
+
+    if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;  // Somebody else got it; there may be more
+
+    return 1;
+}
+
+// ------------------- The shared queue -------------------
+
+static int shared_push(struct threadpool *pool, void (*fn)(void *), void **args, int n)  // With the lock held
+{
+    if (pool->shared_count + n > pool->shared_size) {
+        long size = pool->shared_size;
+
+        while (pool->shared_count + n > size)
+            size *= 2;
+
+        struct tp_task *bigger = malloc(size * sizeof *bigger);
+
+        if (bigger == NULL) return -1;
+
+        for (long i = 0; i < pool->shared_count; i++)
+            bigger[i] = pool->shared[(pool->shared_head + i) % pool->shared_size];
+
+        free(pool->shared);
+        pool->shared = bigger;
+        pool->shared_head = 0;
+        pool->shared_size = size;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct tp_task *slot = &pool->shared[(pool->shared_head + pool->shared_count + i) % pool->shared_size];
+
+        slot->fn = fn;
+        slot->arg = args[i];
+    }
+
+    __atomic_store_n(&pool->shared_count, pool->shared_count + n, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int shared_take(struct threadpool *pool, struct tp_task *task)
+{
+    if (__atomic_load_n(&pool->shared_count, __ATOMIC_RELAXED) == 0) return 0;  // Don't take the lock for nothing
+
+    int got = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->shared_count > 0) {
+        *task = pool->shared[pool->shared_head];
+        pool->shared_head = (pool->shared_head + 1) % pool->shared_size;
+        __atomic_store_n(&pool->shared_count, pool->shared_count - 1, __ATOMIC_RELAXED);
+        got = 1;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return got;
+}
+
+// ------------------- Running tasks -------------------
+
+static unsigned long long next_random(unsigned long long *rng)  // xorshift64
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+
+    return *rng;
+}
+
+static struct tp_worker *own_worker(struct threadpool *pool)  // This thread's worker in pool, or NULL
+{
+    return self != NULL && self->pool == pool? self: NULL;
+}
+
+// Find something to run: our own newest task, then the oldest one from
+// outside, then somebody else's oldest, starting with a random victim so
+// the thieves spread out.
+static int find_task(struct threadpool *pool, struct tp_task *task)
+{
+    struct tp_worker *me = own_worker(pool);
+    int got = (me != NULL && deque_take(me, task)) || shared_take(pool, task);
+
+    for (int round = 0; !got && round < THREADPOOL_STEAL_TRIES; round++) {
+        int start = next_random(me != NULL? &me->rng: &outsider_rng) % pool->size;
+        int contended = 0;
+
+        for (int i = 0; !got && i < pool->size; i++) {
+            struct tp_worker *victim = &pool->workers[(start + i) % pool->size];
+
+            if (victim == me) continue;
+
+            int result = deque_steal(victim, task);
+
+            got = result == 1;
+            contended |= result == -1;
+        }
+
+        if (!contended) break;  // Everybody really was empty
+    }
+
+    if (got) __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+    return got;
+}
+
+static void run_task(struct threadpool *pool, struct tp_task *task)
+{
+    task->fn(task->arg);
+
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Wake up to n sleeping workers. The sleeping count is read after queued
+// went up, and a worker bumps sleeping before it looks at queued, so one
+// of the two sees the other.
+static void wake_workers(struct threadpool *pool, int n)
+{
+    if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) == 0) return;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (n >= pool->sleeping) {
+        pthread_cond_broadcast(&pool->wake);
+    } else {
+        while (n-- > 0)
+            pthread_cond_signal(&pool->wake);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pin(int id)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(id % (cpus > 0? cpus: 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+static void *worker_run(void *arg)
+{
+    struct tp_worker *w = arg;
+    struct threadpool *pool = w->pool;
+    struct tp_task task;
+
+    self = w;
+
+    if (pool->flags & THREADPOOL_PIN)
+        pin(w->id);
+
+    for (;;) {
+        if (find_task(pool, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        __atomic_fetch_add(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+
+        __atomic_fetch_sub(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// ------------------- The pool -------------------
+
+struct threadpool *threadpool_create(int workers, int flags)
+{
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        workers = cpus > 0? cpus: 1;
+    }
+
+    struct threadpool *pool = malloc(sizeof *pool);
+
+    if (pool == NULL) return NULL;
+
+    memset(pool, 0, sizeof *pool);
+    pool->flags = flags;
+    pool->shared_size = THREADPOOL_DEQUE_SIZE;
+    pool->shared = malloc(pool->shared_size * sizeof *pool->shared);
+    pool->workers = aligned_alloc(THREADPOOL_CACHE_LINE, workers * sizeof *pool->workers);
+
+    if (pool->shared == NULL || pool->workers == NULL) {
+        free(pool->shared);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    memset(pool->workers, 0, workers * sizeof *pool->workers);
+
+    for (int i = 0; i < workers; i++) {
+        struct tp_worker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->id = i;
+        w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        w->array = malloc(sizeof *w->array + THREADPOOL_DEQUE_SIZE * sizeof w->array->tasks[0]);
+
+        if (w->array == NULL) {
+            threadpool_free(pool);
+            return NULL;
+        }
+
+        w->array->size = THREADPOOL_DEQUE_SIZE;
+        w->array->retired = NULL;
+        pool->size++;  // threadpool_free() only cleans up the ones we got to
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_run, &pool->workers[i]) != 0) {
+            threadpool_free(pool);  // Joins the ones that started
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void threadpool_free(struct threadpool *pool)
+{
+    threadpool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->size; i++) {
+        if (pool->workers[i].thread != 0)
+            pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->size; i++) {
+        struct tp_array *a = pool->workers[i].array;
+
+        while (a != NULL) {
+            struct tp_array *retired = a->retired;
+
+            free(a);
+            a = retired;
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->shared);
+    free(pool->workers);
+    free(pool);
+}
+
+int threadpool_submit_batch(struct threadpool *pool, void (*fn)(void *), void **args, int n)
+{
+    struct tp_worker *me = own_worker(pool);
+    int result;
+
+    if (n <= 0) return 0;
+
+    __atomic_fetch_add(&pool->pending, n, __ATOMIC_ACQ_REL);  // Before anybody can run them and count them off
+
+    if (me != NULL) {
+        result = deque_push(me, fn, args, n);
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        result = shared_push(pool, fn, args, n);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (result == -1) {
+        __atomic_fetch_sub(&pool->pending, n, __ATOMIC_ACQ_REL);
+        return -1;
+    }
+
+    __atomic_fetch_add(&pool->queued, n, __ATOMIC_SEQ_CST);
+    wake_workers(pool, n);
+
+    return 0;
+}
+
+int threadpool_submit(struct threadpool *pool, void (*fn)(void *), void *arg)
+{
+    return threadpool_submit_batch(pool, fn, &arg, 1);
+}
+
+// Until every task submitted so far, and every one they submit, has run.
+// Not from inside one of the pool's tasks, which would be waiting for
+// itself.
+void threadpool_wait(struct threadpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void run_chunk(void *arg)
+{
+    struct tp_chunk *chunk = arg;
+    struct tp_loop *loop = chunk->loop;
+
+    loop->fn(chunk->lo, chunk->hi, loop->arg);
+
+    __atomic_fetch_sub(&loop->remaining, 1, __ATOMIC_RELEASE);
+}
+
+// The chunks go out as one batch, and then the caller runs tasks, these
+// or anybody's, until its own are all done. Taking part is what makes it
+// safe to call from a task: the worker it's on isn't just sitting there.
+int threadpool_parallel_for(struct threadpool *pool, long begin, long end, long grain,
+                            void (*fn)(long lo, long hi, void *arg), void *arg)
+{
+    if (begin >= end) return 0;
+
+    if (grain <= 0) {
+        grain = (end - begin) / ((long)pool->size * THREADPOOL_CHUNKS);
+
+        if (grain < 1) grain = 1;
+    }
+
+    long n = (end - begin + grain - 1) / grain;
+
+    if (n > INT_MAX) return -1;  // More chunks than a batch can hold
+
+    struct tp_loop loop = { fn, arg, n };
+    struct tp_chunk *chunks = malloc(n * sizeof *chunks);
+    void **args = malloc(n * sizeof *args);
+
+    if (chunks == NULL || args == NULL) {
+        free(chunks);
+        free(args);
+        return -1;
+    }
+
+    for (long i = 0; i < n; i++) {
+        chunks[i].loop = &loop;
+        chunks[i].lo = begin + i * grain;
+        chunks[i].hi = chunks[i].lo + grain < end? chunks[i].lo + grain: end;
+        args[i] = &chunks[i];
+    }
+
+    if (threadpool_submit_batch(pool, run_chunk, args, n) == -1) {
+        free(chunks);
+        free(args);
+        return -1;
+    }
+
+    struct tp_task task;
+
+    while (__atomic_load_n(&loop.remaining, __ATOMIC_ACQUIRE) > 0) {
+        if (find_task(pool, &task))
+            run_task(pool, &task);
+        else
+            sched_yield();  // The rest are running somewhere
+    }
+
+    free(chunks);
+    free(args);
+
+    return 0;
+}
+
+int threadpool_size(struct threadpool *pool)
+{
+    return pool->size;
+}
+
+int threadpool_worker_id(void)
+{
+    return self != NULL? self->id: -1;
+}
@@ -0,0 +1,87 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/*
+ * Functions:
+ *
+ *   threadpool_create()       -- start a pool of worker threads
+ *   threadpool_free()         -- wait for the pool's tasks, then stop it
+ *   threadpool_submit()       -- run fn(arg) on some worker
+ *   threadpool_submit_batch() -- run fn(args[i]) for each of n args
+ *   threadpool_wait()         -- wait until every submitted task has run
+ *   threadpool_parallel_for() -- run fn over [begin, end) in chunks
+ *   threadpool_size()         -- how many workers the pool has
+ *   threadpool_worker_id()    -- which worker is running us, or -1
+ *
+ * Example Usage:
+ *
+ *   #include "threadpool.h"
+ *
+ *   void hello(void *arg)
+ *   {
+ *       printf("%s from worker %d\n", (char *)arg, threadpool_worker_id());
+ *   }
+ *
+ *   struct threadpool *pool = threadpool_create(4, 0);
+ *
+ *   threadpool_submit(pool, hello, "hi");
+ *   threadpool_submit(pool, hello, "there");
+ *   threadpool_wait(pool);
+ *
+ *   threadpool_free(pool);
+ *
+ * How it works
+ *
+ *   Every worker has a Chase-Lev deque of tasks. A task submitted from
+ *   a worker, say one that splits its job in two, goes on the bottom of
+ *   that worker's own deque, with no lock, and the worker takes its
+ *   newest task back off the bottom. A worker that runs out steals the
+ *   oldest task off the top of somebody else's deque, so an uneven load
+ *   spreads itself out. Tasks submitted from outside the pool go in a
+ *   shared queue that idle workers check before they steal.
+ *
+ *   Workers with nothing to do sleep on a condition variable. A
+ *   submitter only takes the lock to wake one up when the sleeping count
+ *   says somebody is asleep.
+ *
+ *   threadpool_submit_batch() publishes all n tasks at once and wakes up
+ *   to n sleepers, so it's cheaper than n threadpool_submit()s.
+ *
+ *   threadpool_parallel_for(pool, begin, end, grain, fn, arg) calls
+ *   fn(lo, hi, arg) on chunks of up to grain indexes covering
+ *   [begin, end), and returns when they've all run. A grain of 0 picks
+ *   one that makes a few chunks per worker. The calling thread runs
+ *   chunks too while it waits, so it's fine to call from inside a task.
+ *
+ *   Tasks run to completion on whatever worker picks them up. One that
+ *   blocks, waiting for a semaphore say, keeps its worker, so a pool
+ *   running tasks that wait for each other needs a worker for every one
+ *   of them.
+ *
+ * Flags
+ *
+ *   THREADPOOL_PIN   Pin worker i to CPU i % (number of CPUs).
+ *
+ * Compilation instructions
+ *
+ *   Compile threadpool.c along with your program and link with
+ *   -lpthread. From a project directory next to this one:
+ *
+ *   gcc -Wall -Wextra -I../threadpool -o foo foo.c ../threadpool/threadpool.c -lpthread
+ */
+
+#define THREADPOOL_PIN 1
+
+struct threadpool;
+
+struct threadpool *threadpool_create(int workers, int flags);
+void threadpool_free(struct threadpool *pool);
+int threadpool_submit(struct threadpool *pool, void (*fn)(void *), void *arg);
+int threadpool_submit_batch(struct threadpool *pool, void (*fn)(void *), void **args, int n);
+void threadpool_wait(struct threadpool *pool);
+int threadpool_parallel_for(struct threadpool *pool, long begin, long end, long grain,
+                            void (*fn)(long lo, long hi, void *arg), void *arg);
+int threadpool_size(struct threadpool *pool);
+int threadpool_worker_id(void);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "threadpool.h"
+#include "ctest.h"
+
+#ifdef CTEST_ENABLE
+
+#define TEST_WORKERS 4
+#define TEST_TASKS 10000
+#define TEST_STOLEN 1000    // More than one deque's starting size, so it has to grow
+#define TEST_DEPTH 12       // spawn() makes 2^TEST_DEPTH leaves
+#define TEST_RANGE 1000000
+
+static struct threadpool *pool;
+static long total;
+static int ran_on[TEST_STOLEN];
+static unsigned char seen[TEST_RANGE];
+
+static void add(void *arg)
+{
+    __atomic_fetch_add(&total, (long)arg, __ATOMIC_RELAXED);
+}
+
+static void spawn(void *arg)  // From inside a worker, so these go on its own deque
+{
+    long depth = (long)arg;
+
+    if (depth == 0) {
+        add((void *)1L);
+        return;
+    }
+
+    threadpool_submit(pool, spawn, (void *)(depth - 1));
+    threadpool_submit(pool, spawn, (void *)(depth - 1));
+}
+
+static void record_worker(void *arg)
+{
+    __atomic_store_n(&ran_on[(long)arg], threadpool_worker_id(), __ATOMIC_RELAXED);
+    add((void *)1L);
+}
+
+// Push a batch on our own deque and then don't take any of it back: the
+// only way they run is if the other workers steal them.
+static void push_and_spin(void *arg)
+{
+    void *args[TEST_STOLEN];
+    time_t give_up = time(NULL) + 10;
+
+    (void)arg;
+
+    for (long i = 0; i < TEST_STOLEN; i++)
+        args[i] = (void *)i;
+
+    threadpool_submit_batch(pool, record_worker, args, TEST_STOLEN);
+
+    while (__atomic_load_n(&total, __ATOMIC_RELAXED) < TEST_STOLEN && time(NULL) < give_up) {
+    }
+}
+
+static void mark(long lo, long hi, void *arg)
+{
+    (void)arg;
+
+    for (long i = lo; i < hi; i++)
+        __atomic_fetch_add(&seen[i], 1, __ATOMIC_RELAXED);
+}
+
+static void nested(long lo, long hi, void *arg)  // A parallel_for from inside a parallel_for's chunk
+{
+    (void)arg;
+
+    for (long i = lo; i < hi; i++)
+        threadpool_parallel_for(pool, i * 1000, (i + 1) * 1000, 7, mark, NULL);
+}
+
+static int all_seen_once(void)
+{
+    for (long i = 0; i < TEST_RANGE; i++)
+        if (seen[i] != 1)
+            return 0;
+
+    return 1;
+}
+
+void test_create(void)
+{
+    pool = threadpool_create(TEST_WORKERS, 0);
+    CTEST_ASSERT(pool != NULL, "threadpool_create() makes a pool");
+    CTEST_ASSERT(threadpool_size(pool) == TEST_WORKERS, "it has the workers we asked for");
+    CTEST_ASSERT(threadpool_worker_id() == -1, "the main thread isn't one of them");
+    threadpool_free(pool);
+
+    pool = threadpool_create(0, THREADPOOL_PIN);
+    CTEST_ASSERT(pool != NULL, "a pinned pool, one worker per CPU");
+    CTEST_ASSERT(threadpool_size(pool) >= 1, "there's at least one CPU");
+    threadpool_free(pool);
+}
+
+void test_submit(void)
+{
+    pool = threadpool_create(TEST_WORKERS, 0);
+
+    total = 0;
+    for (long i = 0; i < TEST_TASKS; i++)
+        threadpool_submit(pool, add, (void *)i);
+    threadpool_wait(pool);
+    CTEST_ASSERT(total == (long)TEST_TASKS * (TEST_TASKS - 1) / 2, "every submitted task runs once");
+
+    void *args[100];
+    for (int i = 0; i < 100; i++)
+        args[i] = (void *)1L;
+    total = 0;
+    for (int i = 0; i < 100; i++)
+        threadpool_submit_batch(pool, add, args, 100);
+    threadpool_wait(pool);
+    CTEST_ASSERT(total == 10000, "every task in every batch runs once");
+
+    CTEST_ASSERT(threadpool_submit_batch(pool, add, args, 0) == 0, "an empty batch is fine");
+
+    threadpool_free(pool);
+}
+
+void test_submit_from_worker(void)
+{
+    pool = threadpool_create(TEST_WORKERS, 0);
+
+    total = 0;
+    threadpool_submit(pool, spawn, (void *)(long)TEST_DEPTH);
+    threadpool_wait(pool);
+    CTEST_ASSERT(total == 1L << TEST_DEPTH, "tasks that submit tasks: all of them run");
+
+    threadpool_free(pool);
+}
+
+void test_steal(void)
+{
+    pool = threadpool_create(TEST_WORKERS, 0);
+
+    total = 0;
+    memset(ran_on, -1, sizeof ran_on);
+    threadpool_submit(pool, push_and_spin, NULL);
+    threadpool_wait(pool);
+    CTEST_ASSERT(total == TEST_STOLEN, "the other workers stole the whole batch");
+
+    int everywhere = 1;
+    for (int i = 0; i < TEST_STOLEN; i++)
+        everywhere &= ran_on[i] >= 0 && ran_on[i] < TEST_WORKERS;
+    CTEST_ASSERT(everywhere, "every stolen task ran on a worker");
+
+    threadpool_free(pool);
+}
+
+void test_parallel_for(void)
+{
+    pool = threadpool_create(TEST_WORKERS, 0);
+
+    memset(seen, 0, sizeof seen);
+    CTEST_ASSERT(threadpool_parallel_for(pool, 0, TEST_RANGE, 0, mark, NULL) == 0, "parallel_for picks a grain");
+    CTEST_ASSERT(all_seen_once(), "every index, once");
+
+    memset(seen, 0, sizeof seen);
+    threadpool_parallel_for(pool, 0, TEST_RANGE, 999, mark, NULL);
+    CTEST_ASSERT(all_seen_once(), "with a grain that doesn't divide the range");
+
+    memset(seen, 0, sizeof seen);
+    threadpool_parallel_for(pool, 0, TEST_RANGE / 1000, 0, nested, NULL);
+    CTEST_ASSERT(all_seen_once(), "parallel_for inside parallel_for");
+
+    CTEST_ASSERT(threadpool_parallel_for(pool, 5, 5, 0, mark, NULL) == 0, "an empty range is fine");
+
+    threadpool_free(pool);
+}
+
+#endif
+
+int main(void)
+{
+    #ifdef CTEST_ENABLE
+    CTEST_VERBOSE(1);
+
+    test_create();
+    test_submit();
+    test_submit_from_worker();
+    test_steal();
+    test_parallel_for();
+
+    CTEST_RESULTS();
+    CTEST_EXIT();
+    #endif
+}